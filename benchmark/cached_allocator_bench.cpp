@@ -0,0 +1,258 @@
+/* Copyright (c) 2018 Zhenyu Zhang. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+//
+// Micro-benchmark of __alloc/__free against malloc/free under multi-thread contention.
+// Build(From this directory):
+//   g++ -std=c++11 -O2 -I../src -I<libuv include> cached_allocator_bench.cpp ../src/cached_allocator.cpp -lpthread -o cached_allocator_bench
+// Usage:
+//   cached_allocator_bench [operations per thread] [max threads]
+//   Preload another allocator(LD_PRELOAD=libjemalloc.so or libtcmalloc.so) to compare it in the malloc rows.
+// Patterns:
+//   cross: loop thread allocates and worker thread frees(The Cbuffer send pattern), threads work in pairs.
+//   churn: same thread allocates and frees with a small live window.
+//   mixed: churn with the sizes cached by initStoreNumber.
+// One of every 64 operations is timed for the p99 latency(Clock overhead included).
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "cached_allocator.h"
+#include "buffer.h"
+#include "network_node.h"
+#include "uv_wrapper.h"
+#include "network_pool.h"
+#include "recv_buffer.h"
+#include "mt_shared_ptr.h"
+#include "http_context.h"
+#include "json_context.h"
+
+using namespace NETWORK_POOL;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const size_t s_sampleMask = 63;
+static const size_t s_window = 64; // Live blocks per thread in churn.
+static const size_t s_ringSize = 1024;
+
+struct __allocator
+{
+	const char *name;
+	void *(*alloc)(const size_t size);
+	void (*free)(void * const ptr);
+};
+
+static void *mallocWrapper(const size_t size)
+{
+	return malloc(size);
+}
+
+static void freeWrapper(void * const ptr)
+{
+	free(ptr);
+}
+
+static const __allocator s_allocators[] =
+{
+	{ "malloc", mallocWrapper, freeWrapper },
+	{ "__alloc", __alloc, __free }
+};
+
+struct __result
+{
+	uint64_t ops;
+	std::vector<uint32_t> samples; // In ns.
+};
+
+static std::vector<size_t> s_mixedSizes;
+
+static void initSizes()
+{
+	const size_t sizes[] =
+	{
+		sizeof(uv_shutdown_t), sizeof(uv_connect_t), sizeof(Cbuffer), sizeof(Csockaddr), sizeof(CnetworkNode),
+		sizeof(Ctcp), sizeof(CnetworkPool::__write_with_info), sizeof(CnetworkPool::__udp_send_with_info),
+		RECV_BUFFER_SIZE, sizeof(CatomicCounter), sizeof(ChttpContext), sizeof(CjsonContext)
+	};
+	s_mixedSizes.assign(sizes, sizes + sizeof(sizes) / sizeof(sizes[0]));
+}
+
+static inline uint32_t rng(uint32_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+// Timed or untimed call.
+#define bench_op(_index, _result, _expr) do \
+	{ \
+		if (0 == ((_index) & s_sampleMask)) \
+		{ \
+			bench_clock::time_point _start = bench_clock::now(); \
+			_expr; \
+			(_result).samples.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - _start).count()); \
+		} \
+		else \
+			_expr; \
+	} while (0)
+
+static void churn(const __allocator& allocator, const size_t number, const bool bMixed, const unsigned int seed, __result& result)
+{
+	void *live[s_window] = { 0 };
+	uint32_t state = seed * 2654435761u + 1;
+	for (size_t i = 0; i < number; ++i)
+	{
+		size_t slot = rng(state) % s_window;
+		size_t size = bMixed ? s_mixedSizes[rng(state) % s_mixedSizes.size()] : 64 + rng(state) % 1024;
+		if (live[slot] != nullptr)
+			bench_op(i, result, allocator.free(live[slot]));
+		bench_op(i + 1, result, live[slot] = allocator.alloc(size));
+		*(char *)live[slot] = 0;
+	}
+	for (size_t i = 0; i < s_window; ++i)
+	{
+		if (live[i] != nullptr)
+			allocator.free(live[i]);
+	}
+	result.ops = number * 2;
+}
+
+// Single producer single consumer ring.
+struct __ring
+{
+	void *m_slots[s_ringSize];
+	std::atomic<size_t> m_head;
+	char m_pad[64];
+	std::atomic<size_t> m_tail;
+
+	__ring()
+		:m_head(0), m_tail(0) {}
+};
+
+static void producer(const __allocator& allocator, const size_t number, __ring& ring, const unsigned int seed, __result& result)
+{
+	uint32_t state = seed * 2654435761u + 1;
+	for (size_t i = 0; i < number; ++i)
+	{
+		void *ptr;
+		bench_op(i, result, ptr = allocator.alloc(64 + rng(state) % 4096));
+		*(char *)ptr = 0;
+		size_t head = ring.m_head.load(std::memory_order_relaxed);
+		while (head - ring.m_tail.load(std::memory_order_acquire) >= s_ringSize)
+			std::this_thread::yield();
+		ring.m_slots[head % s_ringSize] = ptr;
+		ring.m_head.store(head + 1, std::memory_order_release);
+	}
+	result.ops = number;
+}
+
+static void consumer(const __allocator& allocator, const size_t number, __ring& ring, __result& result)
+{
+	for (size_t i = 0; i < number; ++i)
+	{
+		size_t tail = ring.m_tail.load(std::memory_order_relaxed);
+		while (ring.m_head.load(std::memory_order_acquire) == tail)
+			std::this_thread::yield();
+		void *ptr = ring.m_slots[tail % s_ringSize];
+		ring.m_tail.store(tail + 1, std::memory_order_release);
+		bench_op(i, result, allocator.free(ptr));
+	}
+	result.ops = number;
+}
+
+static void report(const char *pattern, const __allocator& allocator, const size_t threadNumber, const double seconds, std::vector<__result>& results)
+{
+	uint64_t ops = 0;
+	std::vector<uint32_t> samples;
+	for (auto& result : results)
+	{
+		ops += result.ops;
+		samples.insert(samples.end(), result.samples.begin(), result.samples.end());
+	}
+	uint32_t p99 = 0;
+	if (!samples.empty())
+	{
+		size_t index = samples.size() * 99 / 100;
+		std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+		p99 = samples[index];
+	}
+	printf("%-6s %-8s threads %3zu  %10.0f ops/s  p99 %6u ns\n", pattern, allocator.name, threadNumber, ops / seconds, p99);
+}
+
+static void run(const char *pattern, const __allocator& allocator, const size_t threadNumber, const size_t number)
+{
+	std::vector<__result> results(threadNumber);
+	std::vector<__ring> rings(threadNumber / 2 + 1);
+	std::vector<std::thread> threads;
+	bench_clock::time_point start = bench_clock::now();
+	for (size_t i = 0; i < threadNumber; ++i)
+	{
+		results[i].samples.reserve(number / s_sampleMask * 2 + 2);
+		if (0 == strcmp(pattern, "cross"))
+		{
+			if (0 == i % 2)
+				threads.push_back(std::thread(producer, std::cref(allocator), number, std::ref(rings[i / 2]), (unsigned int)i, std::ref(results[i])));
+			else
+				threads.push_back(std::thread(consumer, std::cref(allocator), number, std::ref(rings[i / 2]), std::ref(results[i])));
+		}
+		else
+			threads.push_back(std::thread(churn, std::cref(allocator), number, 0 == strcmp(pattern, "mixed"), (unsigned int)i, std::ref(results[i])));
+	}
+	for (auto& thread : threads)
+		thread.join();
+	double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+	report(pattern, allocator, threadNumber, seconds, results);
+}
+
+int main(int argc, char **argv)
+{
+	size_t number = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+	size_t maxThread = argc > 2 ? strtoull(argv[2], nullptr, 10) : 2 * std::thread::hardware_concurrency();
+	if (maxThread < 2)
+		maxThread = 2;
+	initSizes();
+	const char *patterns[] = { "cross", "churn", "mixed" };
+	for (auto pattern : patterns)
+	{
+		for (size_t threadNumber = 1; threadNumber <= maxThread; threadNumber *= 2)
+		{
+			if (0 == strcmp(pattern, "cross") && threadNumber < 2)
+				continue; // One pair at least.
+			for (const auto& allocator : s_allocators)
+				run(pattern, allocator, threadNumber, number);
+		}
+	}
+	size_t count, size;
+	__get_usage_data(count, size);
+	printf("cached allocator usage after run: %zu blocks %zu bytes\n", count, size);
+	return 0;
+}
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <cstring>
+#include <utility>
 
 #include "uv.h"
 
@@ -29,14 +30,49 @@
 
 namespace NETWORK_POOL
 {
+	// How the memory of a transferred buffer is released, __free when release is nullptr.
+	struct __buffer_release
+	{
+		void (*release)(void *context);
+		void *context;
+	};
+
+	// Offset is the bytes skipped at the front of buf.
+	inline void __release_buffer(const uv_buf_t& buf, const __buffer_release& release, const size_t offset = 0)
+	{
+		if (release.release != nullptr)
+			release.release(release.context);
+		else
+			__free(buf.base - offset); // No need to check nullptr.
+	}
+
 	class Cbuffer : public CcachedAllocator
 	{
+	public:
+		typedef void (*release_callback)(void *context);
+
 	private:
 		void *m_data;
 		size_t m_length;
 		size_t m_maxLength;
+		release_callback m_release; // Not nullptr when data is borrowed.
+		void *m_context;
 
-		inline void transfer(uv_buf_t& buf) // Internal use only.
+		static void noRelease(void *context) {}
+
+		inline void freeData()
+		{
+			if (m_release != nullptr)
+			{
+				m_release(m_context);
+				m_release = nullptr;
+				m_context = nullptr;
+			}
+			else
+				__free(m_data); // No need to check nullptr.
+		}
+
+		inline void transfer(uv_buf_t& buf, __buffer_release& release) // Internal use only.
 		{
 			buf.base = (char *)m_data;
 		#ifdef _MSC_VER
@@ -44,16 +80,21 @@ namespace NETWORK_POOL
 		#else
 			buf.len = m_length;
 		#endif
+			release.release = m_release;
+			release.context = m_context;
 			m_data = nullptr;
 			m_maxLength = m_length = 0;
+			m_release = nullptr;
+			m_context = nullptr;
 		}
 
 		friend class CnetworkPool;
 
 	public:
 		Cbuffer()
-			:m_data(nullptr), m_length(0), m_maxLength(0) {}
+			:m_data(nullptr), m_length(0), m_maxLength(0), m_release(nullptr), m_context(nullptr) {}
 		Cbuffer(const size_t length)
+			:m_release(nullptr), m_context(nullptr)
 		{
 			if (0 == length)
 			{
@@ -67,6 +108,7 @@ namespace NETWORK_POOL
 			}
 		}
 		Cbuffer(const void * const data, const size_t length)
+			:m_release(nullptr), m_context(nullptr)
 		{
 			if (0 == length)
 			{
@@ -81,6 +123,7 @@ namespace NETWORK_POOL
 			}
 		}
 		Cbuffer(const Cbuffer& another)
+			:m_release(nullptr), m_context(nullptr) // Copy of borrowed data is owned.
 		{
 			if (0 == another.m_length)
 			{
@@ -95,14 +138,35 @@ namespace NETWORK_POOL
 			}
 		}
 		Cbuffer(Cbuffer&& another)
-			:m_data(another.m_data), m_length(another.m_length), m_maxLength(another.m_maxLength)
+			:m_data(another.m_data), m_length(another.m_length), m_maxLength(another.m_maxLength), m_release(another.m_release), m_context(another.m_context)
 		{
 			another.m_data = nullptr;
 			another.m_maxLength = another.m_length = 0;
+			another.m_release = nullptr;
+			another.m_context = nullptr;
 		}
 		~Cbuffer()
 		{
-			__free(m_data); // No need to check nullptr.
+			freeData();
+		}
+
+		// Borrow the data without copy, it must stay unchanged until release(context) is called(Sent, dropped or buffer destroyed).
+		// Release can be nullptr for static data. Changing the size of borrowed buffer makes an owned copy.
+		static Cbuffer borrow(const void * const data, const size_t length, const release_callback release = nullptr, void * const context = nullptr)
+		{
+			Cbuffer buf;
+			if (0 == length)
+			{
+				if (release != nullptr)
+					release(context);
+				return buf;
+			}
+			buf.m_data = (void *)data;
+			buf.m_length = length;
+			buf.m_maxLength = 0; // Never written.
+			buf.m_release = nullptr == release ? noRelease : release;
+			buf.m_context = context;
+			return buf;
 		}
 
 		const Cbuffer& operator=(const Cbuffer& another)
@@ -115,21 +179,28 @@ namespace NETWORK_POOL
 			}
 			else
 			{
-				__free(m_data); // No need to check nullptr.
-				m_data = __alloc_throw(another.m_length);
-				memcpy(m_data, another.m_data, another.m_length);
+				void *newBuffer = __alloc_throw(another.m_length);
+				memcpy(newBuffer, another.m_data, another.m_length);
+				freeData();
+				m_data = newBuffer;
 				m_maxLength = m_length = another.m_length;
 			}
 			return *this;
 		}
 		const Cbuffer& operator=(Cbuffer&& another)
 		{
-			__free(m_data); // No need to check nullptr.
+			if (&another == this)
+				return *this;
+			freeData();
 			m_data = another.m_data;
 			m_length = another.m_length;
 			m_maxLength = another.m_maxLength;
+			m_release = another.m_release;
+			m_context = another.m_context;
 			another.m_data = nullptr;
 			another.m_maxLength = another.m_length = 0;
+			another.m_release = nullptr;
+			another.m_context = nullptr;
 			return *this;
 		}
 
@@ -143,9 +214,10 @@ namespace NETWORK_POOL
 			}
 			else
 			{
-				__free(m_data); // No need to check nullptr.
-				m_data = __alloc_throw(length);
-				memcpy(m_data, data, length);
+				void *newBuffer = __alloc_throw(length);
+				memcpy(newBuffer, data, length);
+				freeData();
+				m_data = newBuffer;
 				m_maxLength = m_length = length;
 			}
 		}
@@ -163,22 +235,30 @@ namespace NETWORK_POOL
 			{
 				void *newBuffer = __alloc_throw(preferLength);
 				memcpy(newBuffer, m_data, copy);
-				__free(m_data);
+				freeData();
 				m_data = newBuffer;
 				m_maxLength = m_length = preferLength;
 			}
 			else
 			{
-				__free(m_data); // No need to check nullptr.
+				freeData();
+				m_data = nullptr; // In case of exception.
+				m_maxLength = m_length = 0;
 				m_data = __alloc_throw(preferLength);
 				m_maxLength = m_length = preferLength;
 			}
 		}
 
+		// Data of borrowed buffer is owned by the caller of borrow and may be read only(Static data), never write through it.
+		// Call set or resize first to make an owned copy if needed.
 		inline void *getData() const
 		{
 			return m_data;
 		}
+		inline bool isBorrowed() const
+		{
+			return m_release != nullptr;
+		}
 		inline size_t getLength() const
 		{
 			return m_length;
@@ -23,6 +23,15 @@
 #include <mutex>
 #include <thread>
 #include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <new>
+#ifdef _MSC_VER
+	#include <malloc.h>
+#endif
+#ifdef __linux__
+	#include <sys/mman.h>
+#endif
 
 #include "uv.h"
 
@@ -37,9 +46,9 @@
 #include "json_context.h"
 
 #define CA_DBG 0
+#include <cstring>
 #if CA_DBG
 	#include <stdio.h>
-	#include <cstring>
 	#define CA_FPRINTF(_x) { fprintf _x; }
 #else
 	#define CA_FPRINTF(_x) {}
@@ -47,17 +56,479 @@
 
 namespace NETWORK_POOL
 {
-	static const size_t s_maxAllocatorSlot = 0x1000; // Only cache block which small than 4KB.
+	//
+	// Size class.
+	// Block smaller than 4KB is rounded up to 16 bytes(Granule), and block in [4KB, 1MB] is rounded up to a size class,
+	// 4 classes between every power of two(jemalloc style).
+	// Slot [0, s_maxAllocatorSlot) is granule, and slot [s_maxAllocatorSlot, s_slotNumber) is size class.
+	//
+
+	static const size_t s_granule = 16;
+	static const size_t s_minClassSize = 0x1000; // 4KB.
+	static const size_t s_maxClassSize = 0x100000; // 1MB.
+	static const size_t s_maxAllocatorSlot = s_minClassSize / s_granule - 1; // Block in (4080, 4096] is the first class.
+	static const size_t s_classPerGroup = 4;
+	static const size_t s_classNumber = 33; // 8 doubling from 4KB to 1MB, and 1MB itself.
+	static const size_t s_slotNumber = s_maxAllocatorSlot + s_classNumber;
+
+	static inline size_t classToSize(const size_t index)
+	{
+		size_t base = s_minClassSize << (index / s_classPerGroup);
+		return base + (index % s_classPerGroup) * (base / s_classPerGroup);
+	}
+
+	// Return s_slotNumber if size is not cacheable.
+	static inline size_t sizeToSlot(const size_t size)
+	{
+		if (size <= s_maxAllocatorSlot * s_granule)
+			return 0 == size ? 0 : (size - 1) / s_granule;
+		if (size <= s_minClassSize)
+			return s_maxAllocatorSlot;
+		if (size > s_maxClassSize)
+			return s_slotNumber;
+		size_t group = 0;
+		while ((s_minClassSize << (group + 1)) <= size)
+			++group;
+		size_t base = s_minClassSize << group;
+		size_t step = base / s_classPerGroup;
+		size_t index = group * s_classPerGroup + (size - base + step - 1) / step; // Next group's first class if overflow.
+		return s_maxAllocatorSlot + index;
+	}
+
+	//
+	// Layout.
+	// Small block(No more than s_maxSlabBlockSize) has no header, it's carved from 64KB aligned slab of its slot,
+	// and the slab header knows the slot. Slab map tells whether a block is in a slab.
+	// Large block(Bigger size class and block bigger than 1MB) is only 64 bytes aligned(Or aligned to the alignment asked),
+	// with a header right before the user pointer, so it wastes no 64KB alignment padding.
+	// So user pointer is 16 bytes aligned(And 64 bytes aligned when the size is multiple of 64 or large).
+	// Hot object type can own a slab slot in [s_slotNumber, s_totalSlotNumber).
+	// Depot of slab slot refills from the slabs when empty, and returns blocks to the slabs when full.
+	//
+
+	static const size_t s_maxSlabNumber = 32;
+	static const size_t s_totalSlotNumber = s_slotNumber + s_maxSlabNumber;
+	static const size_t s_slabSize = 0x10000; // 64KB.
+	static const size_t s_slabHeaderSize = 64; // Keep user data 64 bytes aligned.
+	static const size_t s_slabAlign = s_granule;
+	static const size_t s_minSlabBlockNumber = 8;
+	static const size_t s_maxSlabBlockSize = (s_slabSize - s_slabHeaderSize) / s_minSlabBlockNumber & ~(s_slabAlign - 1);
+	static const size_t s_maxEmptySlab = 1; // Release other empty slab at once.
+	static const size_t s_largeHeaderSize = 64; // Also the alignment of large block.
+
+	struct __slab
+	{
+		size_t m_slot;
+		__slab *m_prev;
+		__slab *m_next;
+		void *m_free; // Free block list of this slab.
+		size_t m_used; // Block in use(Include the block in depot and magazine).
+		size_t m_carved; // Blocks after carved are never used.
+	};
+
+	// Right before the user pointer.
+	struct __large
+	{
+		size_t m_slot;
+		size_t m_size; // Whole block size.
+		size_t m_offset; // User pointer - base.
+	};
 
-	// Usage data.
-	static std::atomic<size_t> s_count(0);
-	static std::atomic<size_t> s_size(0);
+	struct __slab_type
+	{
+		size_t m_size;
+		size_t m_stride;
+		size_t m_blockNumber; // Blocks per slab.
+		__slab *m_partial; // Slabs with free block.
+		size_t m_emptyCount;
+		size_t m_slabCount;
+	};
 
-	// Memory cache.
+	// Memory cache(depot shared by all threads).
 	static std::mutex s_globalLock;
-	static void *s_allocatorStore[s_maxAllocatorSlot] = { 0 };
-	static volatile size_t s_allocatorStoreCount[s_maxAllocatorSlot] = { 0 };
-	static volatile size_t s_maxAllocatorStoreNumber[s_maxAllocatorSlot] = { 0 };
+	static void *s_allocatorStore[s_totalSlotNumber] = { 0 };
+	static volatile size_t s_allocatorStoreCount[s_totalSlotNumber] = { 0 };
+	static volatile size_t s_maxAllocatorStoreNumber[s_totalSlotNumber] = { 0 };
+	static size_t s_baseStoreNumber[s_totalSlotNumber] = { 0 }; // Limit set by user, adaptive limit moves around it.
+	static __slab_type s_slabTypes[s_totalSlotNumber]; // Slab type of small slot is initialized when first used.
+	static std::atomic<size_t> s_slabTypeCount(0);
+
+	static inline size_t slotToSize(const size_t slot)
+	{
+		if (slot < s_maxAllocatorSlot)
+			return (slot + 1) * s_granule;
+		if (slot < s_slotNumber)
+			return classToSize(slot - s_maxAllocatorSlot);
+		return s_slabTypes[slot].m_size;
+	}
+
+	static inline bool isLargeSlot(const size_t slot)
+	{
+		return slot < s_slotNumber && slotToSize(slot) > s_maxSlabBlockSize;
+	}
+
+	// Memory used by a block of slot.
+	static inline size_t slotBlockSize(const size_t slot)
+	{
+		return isLargeSlot(slot) ? s_largeHeaderSize + slotToSize(slot) : slotToSize(slot);
+	}
+
+	//
+	// Huge page arena.
+	// An optional region backed by huge page, carved into 64KB chunks. Slot which uses the arena gets its slabs(Small slot),
+	// or its blocks(Class no smaller than 64KB, run of chunks without header) from the arena, and falls back when the arena is full.
+	// Page map records the slot of every run, so block in arena is found without reading its memory.
+	// Free runs are kept in list by chunk number and reused, the arena is never returned to the OS.
+	// Base and map are set once before any slot uses the arena, so __free reads them without lock.
+	//
+
+	static const size_t s_hugePageSize = 0x200000; // 2MB.
+	static const size_t s_maxRunLength = s_maxClassSize / s_slabSize;
+	static const uint16_t s_arenaSlabMark = 0xFFFF;
+
+	struct __arena_page
+	{
+		uint16_t m_slot; // s_arenaSlabMark for slab.
+		uint16_t m_length; // Chunks of the run.
+	};
+
+	static std::mutex s_arenaLock;
+	// Read by every free without lock, end is published before base.
+	static std::atomic<char *> s_arenaBase(nullptr);
+	static std::atomic<char *> s_arenaEnd(nullptr);
+	static char *s_arenaTop = nullptr;
+	static __arena_page *s_arenaMap = nullptr;
+	static void *s_arenaFree[s_maxRunLength + 1] = { 0 };
+	static volatile bool s_arenaSlot[s_slotNumber] = { 0 };
+
+	static inline bool inArena(const void * const ptr)
+	{
+		const char *base = s_arenaBase.load(std::memory_order_acquire);
+		return base != nullptr && (const char *)ptr >= base && (const char *)ptr < s_arenaEnd.load(std::memory_order_acquire);
+	}
+
+	static inline __arena_page& arenaPage(const void * const ptr)
+	{
+		return s_arenaMap[((const char *)ptr - s_arenaBase.load(std::memory_order_acquire)) / s_slabSize];
+	}
+
+	// Return nullptr when arena is full.
+	static void *arenaAlloc(const size_t slot, const size_t length)
+	{
+		void *ptr;
+		s_arenaLock.lock();
+		ptr = s_arenaFree[length];
+		if (ptr != nullptr)
+			s_arenaFree[length] = *(void **)ptr;
+		else if ((size_t)(s_arenaEnd.load(std::memory_order_relaxed) - s_arenaTop) >= length * s_slabSize)
+		{
+			ptr = s_arenaTop;
+			s_arenaTop += length * s_slabSize;
+		}
+		if (ptr != nullptr)
+		{
+			__arena_page& page = arenaPage(ptr);
+			page.m_slot = isLargeSlot(slot) ? (uint16_t)slot : s_arenaSlabMark;
+			page.m_length = (uint16_t)length;
+		}
+		s_arenaLock.unlock();
+		return ptr;
+	}
+
+	static void arenaFree(void * const ptr)
+	{
+		s_arenaLock.lock();
+		size_t length = arenaPage(ptr).m_length;
+		*(void **)ptr = s_arenaFree[length];
+		s_arenaFree[length] = ptr;
+		s_arenaLock.unlock();
+	}
+
+	// Return true if ptr is a large block in arena.
+	static inline bool arenaRun(const void * const ptr, size_t& slot)
+	{
+		if (!inArena(ptr))
+			return false;
+		const __arena_page& page = arenaPage(ptr);
+		if (s_arenaSlabMark == page.m_slot)
+			return false;
+		slot = page.m_slot;
+		return true;
+	}
+
+	//
+	// Slab map.
+	// Bitmap of 64KB units which hold a slab out of the arena, in leaves of 4GB address space.
+	// Slab is marked and unmarked with s_globalLock held, and leaf is never freed, so __free reads it without lock.
+	// Large block never shares a unit with a live slab, so a block in an unmarked unit is large.
+	//
+
+	static const size_t s_slabMapLeafBits = 16;
+	static const size_t s_slabMapLeafWords = ((size_t)1 << s_slabMapLeafBits) / 64;
+	static const size_t s_slabMapSize = (size_t)1 << ((sizeof(void *) > 4 ? 48 : 32) - 16 - s_slabMapLeafBits); // 48 bits address space.
+	static std::atomic<std::atomic<uint64_t> *> s_slabMap[s_slabMapSize];
+
+	static inline size_t slabUnit(const void * const ptr)
+	{
+		return (size_t)((uintptr_t)ptr / s_slabSize);
+	}
+
+	static inline bool isSlabMemory(const void * const ptr)
+	{
+		size_t unit = slabUnit(ptr);
+		if ((unit >> s_slabMapLeafBits) >= s_slabMapSize)
+			return false;
+		std::atomic<uint64_t> *leaf = s_slabMap[unit >> s_slabMapLeafBits].load(std::memory_order_acquire);
+		if (nullptr == leaf)
+			return false;
+		unit &= ((size_t)1 << s_slabMapLeafBits) - 1;
+		return 0 != (leaf[unit / 64].load(std::memory_order_relaxed) & ((uint64_t)1 << unit % 64));
+	}
+
+	// Should be called with s_globalLock held. Return false if out of address space of map or fail to allocate leaf.
+	static bool markSlab(const void * const slab, const bool bMark)
+	{
+		size_t unit = slabUnit(slab);
+		if ((unit >> s_slabMapLeafBits) >= s_slabMapSize)
+			return false;
+		std::atomic<std::atomic<uint64_t> *>& entry = s_slabMap[unit >> s_slabMapLeafBits];
+		std::atomic<uint64_t> *leaf = entry.load(std::memory_order_relaxed);
+		if (nullptr == leaf)
+		{
+			if (!bMark)
+				return true;
+			leaf = new (std::nothrow) std::atomic<uint64_t>[s_slabMapLeafWords]();
+			if (nullptr == leaf)
+				return false;
+			entry.store(leaf, std::memory_order_release);
+		}
+		unit &= ((size_t)1 << s_slabMapLeafBits) - 1;
+		if (bMark)
+			leaf[unit / 64].fetch_or((uint64_t)1 << unit % 64, std::memory_order_relaxed);
+		else
+			leaf[unit / 64].fetch_and(~((uint64_t)1 << unit % 64), std::memory_order_relaxed);
+		return true;
+	}
+
+	static inline void *allocAlignedMemory(const size_t size, const size_t alignment)
+	{
+	#ifdef _MSC_VER
+		return _aligned_malloc(size, alignment);
+	#else
+		void *ptr = nullptr;
+		return 0 == posix_memalign(&ptr, alignment, size) ? ptr : nullptr;
+	#endif
+	}
+
+	static inline void freeAlignedMemory(void * const ptr)
+	{
+		if (inArena(ptr))
+			return arenaFree(ptr);
+	#ifdef _MSC_VER
+		_aligned_free(ptr);
+	#else
+		free(ptr);
+	#endif
+	}
+
+	// Block of large slot, in arena(No header) or aligned memory.
+	static inline void *allocLargeMemory(const size_t slot)
+	{
+		if (s_arenaSlot[slot])
+		{
+			void *ptr = arenaAlloc(slot, (slotToSize(slot) + s_slabSize - 1) / s_slabSize);
+			if (ptr != nullptr)
+				return ptr;
+		}
+		return allocAlignedMemory(slotBlockSize(slot), s_largeHeaderSize);
+	}
+
+	// Should be called with s_globalLock held.
+	static inline void *allocSlabMemory()
+	{
+		void *slab = allocAlignedMemory(s_slabSize, s_slabSize);
+		if (slab != nullptr && !markSlab(slab, true))
+		{
+			freeAlignedMemory(slab);
+			return nullptr;
+		}
+		return slab;
+	}
+
+	// Should be called with s_globalLock held.
+	static inline void freeSlabMemory(void * const slab)
+	{
+		if (!inArena(slab))
+			markSlab(slab, false); // Before free, the unit may be reused by large block.
+		freeAlignedMemory(slab);
+	}
+
+	static inline void linkSlab(__slab_type& type, __slab * const slab)
+	{
+		slab->m_prev = nullptr;
+		slab->m_next = type.m_partial;
+		if (type.m_partial != nullptr)
+			type.m_partial->m_prev = slab;
+		type.m_partial = slab;
+	}
+
+	static inline void unlinkSlab(__slab_type& type, __slab * const slab)
+	{
+		if (slab->m_prev != nullptr)
+			slab->m_prev->m_next = slab->m_next;
+		else
+			type.m_partial = slab->m_next;
+		if (slab->m_next != nullptr)
+			slab->m_next->m_prev = slab->m_prev;
+	}
+
+	// Should be called with s_globalLock held.
+	static void *slabPop(const size_t slot, bool& bCarved)
+	{
+		__slab_type& type = s_slabTypes[slot];
+		if (0 == type.m_stride)
+		{
+			// Small slot, size is multiple of s_slabAlign.
+			type.m_size = slotToSize(slot);
+			type.m_stride = type.m_size;
+			type.m_blockNumber = (s_slabSize - s_slabHeaderSize) / type.m_stride;
+		}
+		__slab *slab = type.m_partial;
+		if (nullptr == slab)
+		{
+			slab = slot < s_slotNumber && s_arenaSlot[slot] ? (__slab *)arenaAlloc(slot, 1) : nullptr;
+			if (nullptr == slab)
+				slab = (__slab *)allocSlabMemory();
+			if (nullptr == slab)
+				return nullptr;
+			slab->m_slot = slot;
+			slab->m_free = nullptr;
+			slab->m_used = 0;
+			slab->m_carved = 0;
+			linkSlab(type, slab);
+			++type.m_slabCount;
+			++type.m_emptyCount;
+		}
+		void *block;
+		bCarved = nullptr == slab->m_free;
+		if (!bCarved)
+		{
+			block = slab->m_free;
+			slab->m_free = *(void **)block;
+		}
+		else
+			block = (char *)slab + s_slabHeaderSize + type.m_stride * slab->m_carved++;
+		if (0 == slab->m_used++)
+			--type.m_emptyCount;
+		if (slab->m_used == type.m_blockNumber)
+			unlinkSlab(type, slab); // Full.
+		return block;
+	}
+
+	// Should be called with s_globalLock held.
+	static void slabPush(const size_t slot, void * const block)
+	{
+		__slab_type& type = s_slabTypes[slot];
+		__slab *slab = (__slab *)((uintptr_t)block & ~(uintptr_t)(s_slabSize - 1));
+		if (slab->m_used == type.m_blockNumber)
+			linkSlab(type, slab); // Not full now.
+		*(void **)block = slab->m_free;
+		slab->m_free = block;
+		if (0 == --slab->m_used)
+		{
+			if (type.m_emptyCount >= s_maxEmptySlab)
+			{
+				// Release whole slab.
+				unlinkSlab(type, slab);
+				--type.m_slabCount;
+				freeSlabMemory(slab);
+			}
+			else
+				++type.m_emptyCount;
+		}
+	}
+
+	//
+	// Epoch.
+	// Depot records misses, overflows and low-water mark of its count in an epoch, all protected by s_globalLock.
+	// An epoch of a size ends after s_adaptiveEpoch depot operations on the slow path, or at trim, so the limit adapts without trim.
+	// Blocks under the low-water mark sat in depot for the whole epoch, so the limit shrinks by them and trim releases them.
+	// Miss and overflow in the same epoch means blocks go to and come back from the OS, so the limit is too small.
+	//
+
+	static const size_t s_adaptiveFactor = 4; // Adaptive limit is in [base / 4, base * 4].
+	static const size_t s_adaptiveThreshold = 4; // Misses and overflows in an epoch before the limit grows.
+	static const size_t s_adaptiveEpoch = 1024; // Depot operations of a size in an epoch.
+	static size_t s_depotMiss[s_totalSlotNumber] = { 0 };
+	static size_t s_depotOverflow[s_totalSlotNumber] = { 0 };
+	static size_t s_depotLow[s_totalSlotNumber] = { 0 };
+	static size_t s_depotOperations[s_totalSlotNumber] = { 0 };
+	static bool s_bAdaptive = true;
+
+	// Should be called with s_globalLock held. Close the epoch of slot and move its limit.
+	static void adaptDepot(const size_t slot)
+	{
+		size_t count = s_allocatorStoreCount[slot];
+		size_t idle = s_depotLow[slot] < count ? s_depotLow[slot] : count;
+		size_t base = s_baseStoreNumber[slot];
+		if (s_bAdaptive && base != 0)
+		{
+			size_t limit = s_maxAllocatorStoreNumber[slot];
+			size_t floor = base / s_adaptiveFactor != 0 ? base / s_adaptiveFactor : 1;
+			if (s_depotMiss[slot] >= s_adaptiveThreshold && s_depotOverflow[slot] >= s_adaptiveThreshold)
+			{
+				limit = limit != 0 ? limit * 2 : 1;
+				if (limit > base * s_adaptiveFactor)
+					limit = base * s_adaptiveFactor;
+			}
+			else if (idle != 0)
+				limit = limit > floor + idle ? limit - idle : floor;
+			s_maxAllocatorStoreNumber[slot] = limit;
+		}
+		s_depotLow[slot] = count;
+		s_depotMiss[slot] = 0;
+		s_depotOverflow[slot] = 0;
+		s_depotOperations[slot] = 0;
+	}
+
+	// Should be called with s_globalLock held. bCarved is set when the block is freshly carved from slab(Depot is empty).
+	static inline void *depotPop(const size_t slot, bool& bCarved)
+	{
+		bCarved = false;
+		if (++s_depotOperations[slot] >= s_adaptiveEpoch)
+			adaptDepot(slot);
+		void *ptr = s_allocatorStore[slot];
+		if (ptr != nullptr)
+		{
+			s_allocatorStore[slot] = *(void **)ptr;
+			if (--s_allocatorStoreCount[slot] < s_depotLow[slot])
+				s_depotLow[slot] = s_allocatorStoreCount[slot];
+			return ptr;
+		}
+		++s_depotMiss[slot];
+		return isLargeSlot(slot) ? nullptr : slabPop(slot, bCarved);
+	}
+
+	// Should be called with s_globalLock held. Return false if caller should free the block.
+	static inline bool depotPush(const size_t slot, void * const ptr)
+	{
+		if (++s_depotOperations[slot] >= s_adaptiveEpoch)
+			adaptDepot(slot);
+		if (s_allocatorStoreCount[slot] < s_maxAllocatorStoreNumber[slot])
+		{
+			*(void **)ptr = s_allocatorStore[slot];
+			s_allocatorStore[slot] = ptr;
+			++s_allocatorStoreCount[slot];
+			return true;
+		}
+		++s_depotOverflow[slot];
+		if (!isLargeSlot(slot))
+		{
+			slabPush(slot, ptr);
+			return true;
+		}
+		return false;
+	}
 
 	static std::once_flag s_storeNumberInit;
 
@@ -65,7 +536,8 @@ namespace NETWORK_POOL
 	{
 		std::call_once(s_storeNumberInit, []()
 		{
-		#define set_max_store_number(_s, _n) { if ((_s) < s_maxAllocatorSlot && (_n) > s_maxAllocatorStoreNumber[(_s)]) s_maxAllocatorStoreNumber[(_s)] = (_n); }
+			// Slab type inherits the limit of its size when registered.
+		#define set_max_store_number(_s, _n) { size_t _slot = sizeToSlot(_s); if (_slot < s_slotNumber && (_n) > s_maxAllocatorStoreNumber[_slot]) s_maxAllocatorStoreNumber[_slot] = s_baseStoreNumber[_slot] = (_n); }
 			set_max_store_number(sizeof(uv_shutdown_t), 1024);
 			set_max_store_number(sizeof(uv_connect_t), 1024);
 			set_max_store_number(sizeof(Cbuffer), 512);
@@ -83,46 +555,463 @@ namespace NETWORK_POOL
 			set_max_store_number(sizeof(CmtSharedPtr<int>), 0);
 			set_max_store_number(sizeof(ChttpContext), 16384);
 			set_max_store_number(sizeof(CjsonContext), 16384);
+			// Size classes for grown receive buffer and big send buffer.
+			for (size_t index = 0; index < s_classNumber; ++index)
+			{
+				size_t classSize = classToSize(index);
+				if (classSize <= 0x4000)
+					set_max_store_number(classSize, 1024) // 16MB at most.
+				else if (classSize <= 0x20000)
+					set_max_store_number(classSize, 128) // 16MB at most.
+				else
+					set_max_store_number(classSize, 16) // 16MB at most.
+			}
 		#undef set_max_store_number
 		});
 	}
 
-	void *__alloc(const size_t size)
+	//
+	// Thread local magazine.
+	// Each thread keeps a small free list(magazine) for every cached slot, so the common alloc/free take no lock.
+	// Magazine exchanges blocks with the depot in batches, and the depot still obey s_maxAllocatorStoreNumber.
+	// So total cached block of a slot is at most s_maxAllocatorStoreNumber + (thread number) * (magazine capacity).
+	//
+
+	static const size_t s_magazineBytes = 0x8000; // Prefer 32KB per magazine.
+	static const size_t s_minMagazineNumber = 2;
+	static const size_t s_maxMagazineNumber = 64;
+
+	struct __magazine
 	{
-		initStoreNumber();
-		CA_FPRINTF((stderr, "fa alloc %u.\n", size));
-		size_t allocSize = sizeof(size_t) + size;
-		if (allocSize < size) // In case of overflow.
+		void *m_head;
+		size_t m_count;
+		size_t m_carvedCount; // Blocks freshly carved from slab, the next pops count them as miss.
+	};
+
+	static size_t trimDepot();
+
+	//
+	// Auto trim.
+	// No timer thread, the deadline is checked on the slow path(Magazine exchange or depot access), and one thread wins the trim.
+	//
+
+	static std::atomic<uint64_t> s_trimInterval(0); // In ms, 0 means disabled.
+	static std::atomic<uint64_t> s_nextTrim(0);
+
+	static inline uint64_t nowInMs()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static inline void checkAutoTrim()
+	{
+		uint64_t next = s_nextTrim.load(std::memory_order_relaxed);
+		if (0 == next)
+			return;
+		uint64_t now = nowInMs();
+		if (now < next || !s_nextTrim.compare_exchange_strong(next, now + s_trimInterval.load(std::memory_order_relaxed)))
+			return;
+		trimDepot();
+	}
+
+	//
+	// Statistics.
+	// Counters are sharded by thread and only written by the owner thread(Relaxed load and store, no lock prefix),
+	// and __get_cache_stats aggregates them. Thread without cache(Exiting) uses the shared counters with atomic add.
+	// Block which is not cacheable(Bigger than 1MB) is counted in s_hugeSlot.
+	// Occupancy of a thread is hit + miss - free of its counters. Its change is folded into s_occupancy on the slow path
+	// (Magazine exchange, depot access or system allocation), which raises the high-water mark, so the mark lags
+	// at most a magazine per thread and the fast path touches no shared memory.
+	//
+
+	static const size_t s_hugeSlot = s_totalSlotNumber;
+	static const size_t s_statSlotNumber = s_totalSlotNumber + 1;
+
+	enum __stat_type
+	{
+		stat_hit = 0, // Allocate from cache.
+		stat_miss, // Allocate from malloc(Or carve from slab).
+		stat_free_to_cache,
+		stat_free_to_os,
+		stat_number
+	};
+
+	struct __slot_stats
+	{
+		std::atomic<size_t> m_counter[stat_number];
+	};
+
+	struct __thread_cache
+	{
+		__magazine m_magazines[s_totalSlotNumber];
+		__slot_stats m_stats[s_statSlotNumber];
+		size_t m_folded[s_statSlotNumber]; // Occupancy already folded into s_occupancy.
+		std::atomic<size_t> m_count; // Wrap around when free other thread's block, so only the sum is meaningful.
+		std::atomic<size_t> m_bytes;
+		__thread_cache *m_prev;
+		__thread_cache *m_next;
+	};
+
+	static __thread_cache *s_threadCaches = nullptr; // Registry of live thread cache, protected by s_globalLock.
+	static __slot_stats s_sharedStats[s_statSlotNumber]; // Exited thread's counters fold into it.
+	static std::atomic<size_t> s_sharedCount(0);
+	static std::atomic<size_t> s_sharedBytes(0);
+	static std::atomic<size_t> s_occupancy[s_statSlotNumber];
+	static std::atomic<size_t> s_highWater[s_statSlotNumber];
+
+	static inline void increase(std::atomic<size_t>& counter, const size_t value, const bool bOwner)
+	{
+		if (bOwner)
+			counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		else
+			counter.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	static inline size_t occupancyOf(const __slot_stats& stats)
+	{
+		return stats.m_counter[stat_hit].load(std::memory_order_relaxed) + stats.m_counter[stat_miss].load(std::memory_order_relaxed)
+			- stats.m_counter[stat_free_to_cache].load(std::memory_order_relaxed) - stats.m_counter[stat_free_to_os].load(std::memory_order_relaxed);
+	}
+
+	static inline void changeOccupancy(const size_t slot, const size_t delta)
+	{
+		size_t occupancy = s_occupancy[slot].fetch_add(delta, std::memory_order_relaxed) + delta;
+		if ((ptrdiff_t)occupancy <= 0)
+			return;
+		size_t highWater = s_highWater[slot].load(std::memory_order_relaxed);
+		while (occupancy > highWater)
 		{
-			CA_FPRINTF((stderr, "malloc_no_throw size overflow.\n"));
-			std::terminate();
+			if (s_highWater[slot].compare_exchange_weak(highWater, occupancy, std::memory_order_relaxed))
+				break;
+		}
+	}
+
+	// On the slow path.
+	static inline void foldOccupancy(__thread_cache * const cache, const size_t slot)
+	{
+		if (nullptr == cache)
+			return;
+		size_t occupancy = occupancyOf(cache->m_stats[slot]);
+		if (occupancy != cache->m_folded[slot])
+		{
+			changeOccupancy(slot, occupancy - cache->m_folded[slot]);
+			cache->m_folded[slot] = occupancy;
+		}
+	}
+
+	static inline void recordStats(__thread_cache * const cache, const size_t slot, const __stat_type type, const bool bAlloc, const size_t bytes)
+	{
+		if (cache != nullptr)
+		{
+			increase(cache->m_stats[slot].m_counter[type], 1, true);
+			increase(cache->m_count, bAlloc ? 1 : (size_t)-1, true);
+			increase(cache->m_bytes, bAlloc ? bytes : 0 - bytes, true);
+			if (stat_miss == type || stat_free_to_os == type)
+				foldOccupancy(cache, slot); // System allocation is slow anyway.
 		}
-		void *ptr = nullptr;
-		if (size >= s_maxAllocatorSlot || (0 == s_maxAllocatorStoreNumber[size] && 0 == s_allocatorStoreCount[size])) // Just a prob(Accurate calculate will hold the lock).
-			ptr = malloc(allocSize);
 		else
 		{
-			CA_FPRINTF((stderr, "fa alloc use store.\n"));
+			increase(s_sharedStats[slot].m_counter[type], 1, false);
+			increase(s_sharedCount, bAlloc ? 1 : (size_t)-1, false);
+			increase(s_sharedBytes, bAlloc ? bytes : 0 - bytes, false);
+			changeOccupancy(slot, bAlloc ? 1 : (size_t)-1);
+		}
+	}
+
+	// Should be called with s_globalLock held.
+	static void sumStats(const size_t slot, size_t (&counter)[stat_number])
+	{
+		for (int type = 0; type < stat_number; ++type)
+			counter[type] = s_sharedStats[slot].m_counter[type].load(std::memory_order_relaxed);
+		for (__thread_cache *cache = s_threadCaches; cache != nullptr; cache = cache->m_next)
+		{
+			for (int type = 0; type < stat_number; ++type)
+				counter[type] += cache->m_stats[slot].m_counter[type].load(std::memory_order_relaxed);
+		}
+	}
+
+	// Return 0 if block is too big to keep in magazine(Access depot directly).
+	static inline size_t magazineCapacity(const size_t slot)
+	{
+		size_t cap = s_magazineBytes / slotBlockSize(slot);
+		if (cap < s_minMagazineNumber)
+			return 0;
+		return cap > s_maxMagazineNumber ? s_maxMagazineNumber : cap;
+	}
+
+	// Move at most 'number' blocks from magazine to depot, and free the blocks which depot can't hold.
+	static void flushMagazine(__magazine& magazine, const size_t slot, size_t number)
+	{
+		if (number > magazine.m_count)
+			number = magazine.m_count;
+		if (0 == number)
+			return;
+		checkAutoTrim();
+		// Cut the chain outside the lock.
+		void *head = magazine.m_head;
+		void *tail = head;
+		for (size_t i = 1; i < number; ++i)
+			tail = *(void **)tail;
+		magazine.m_head = *(void **)tail;
+		magazine.m_count -= number;
+		if (magazine.m_carvedCount > magazine.m_count)
+			magazine.m_carvedCount = magazine.m_count;
+		// Push as many as we can into depot.
+		void *rest = nullptr;
+		s_globalLock.lock();
+		while (head != nullptr)
+		{
+			void *next = head == tail ? nullptr : *(void **)head;
+			if (!depotPush(slot, head))
+			{
+				*(void **)head = rest;
+				rest = head;
+			}
+			head = next;
+		}
+		s_globalLock.unlock();
+		// Free the rest.
+		while (rest != nullptr)
+		{
+			void *next = *(void **)rest;
+			freeAlignedMemory(rest);
+			rest = next;
+		}
+	}
+
+	// Fill at most 'number' blocks from depot to magazine.
+	static void refillMagazine(__magazine& magazine, const size_t slot, const size_t number)
+	{
+		checkAutoTrim();
+		bool bCarved;
+		s_globalLock.lock();
+		for (size_t i = 0; i < number; ++i)
+		{
+			void *ptr = depotPop(slot, bCarved);
+			if (nullptr == ptr)
+				break;
+			*(void **)ptr = magazine.m_head;
+			magazine.m_head = ptr;
+			++magazine.m_count;
+			if (bCarved)
+				++magazine.m_carvedCount;
+		}
+		s_globalLock.unlock();
+	}
+
+	class CthreadCacheHolder
+	{
+	private:
+		__thread_cache *m_cache;
+		bool m_bDead;
+
+	public:
+		CthreadCacheHolder()
+			:m_cache(nullptr), m_bDead(false) {}
+		~CthreadCacheHolder()
+		{
+			// Return all to depot when thread exit.
+			if (m_cache != nullptr)
+			{
+				for (size_t slot = 0; slot < s_totalSlotNumber; ++slot)
+					flushMagazine(m_cache->m_magazines[slot], slot, m_cache->m_magazines[slot].m_count);
+				// Fold statistics and unregister.
+				s_globalLock.lock();
+				for (size_t slot = 0; slot < s_statSlotNumber; ++slot)
+				{
+					foldOccupancy(m_cache, slot);
+					for (int type = 0; type < stat_number; ++type)
+						increase(s_sharedStats[slot].m_counter[type], m_cache->m_stats[slot].m_counter[type], false);
+				}
+				increase(s_sharedCount, m_cache->m_count, false);
+				increase(s_sharedBytes, m_cache->m_bytes, false);
+				if (m_cache->m_prev != nullptr)
+					m_cache->m_prev->m_next = m_cache->m_next;
+				else
+					s_threadCaches = m_cache->m_next;
+				if (m_cache->m_next != nullptr)
+					m_cache->m_next->m_prev = m_cache->m_prev;
+				s_globalLock.unlock();
+				m_cache->~__thread_cache();
+				free(m_cache);
+				m_cache = nullptr;
+			}
+			m_bDead = true;
+		}
+
+		inline __thread_cache *get()
+		{
+			if (m_cache != nullptr || m_bDead) // Fallback to depot when thread is exiting.
+				return m_cache;
+			void *ptr = malloc(sizeof(__thread_cache));
+			if (nullptr == ptr)
+				return nullptr;
+			m_cache = new (ptr) __thread_cache(); // All zero.
 			s_globalLock.lock();
-			if (s_allocatorStore[size] != nullptr)
+			m_cache->m_prev = nullptr;
+			m_cache->m_next = s_threadCaches;
+			if (s_threadCaches != nullptr)
+				s_threadCaches->m_prev = m_cache;
+			s_threadCaches = m_cache;
+			s_globalLock.unlock();
+			return m_cache;
+		}
+	};
+
+	static thread_local CthreadCacheHolder t_threadCache;
+
+	// Get block from magazine or depot, bMiss is set when the block is freshly carved from slab.
+	static inline void *cachePop(__thread_cache * const cache, const size_t slot, bool& bMiss)
+	{
+		void *ptr = nullptr;
+		bMiss = false;
+		size_t capacity = magazineCapacity(slot);
+		if (cache != nullptr && capacity != 0)
+		{
+			__magazine& magazine = cache->m_magazines[slot];
+			if (nullptr == magazine.m_head)
 			{
-				ptr = s_allocatorStore[size];
-				s_allocatorStore[size] = *(void **)ptr;
-				--s_allocatorStoreCount[size];
+				foldOccupancy(cache, slot);
+				refillMagazine(magazine, slot, capacity / 2);
 			}
+			if (magazine.m_head != nullptr)
+			{
+				ptr = magazine.m_head;
+				magazine.m_head = *(void **)ptr;
+				--magazine.m_count;
+				if (magazine.m_carvedCount != 0)
+				{
+					--magazine.m_carvedCount;
+					bMiss = true;
+				}
+			}
+		}
+		else
+		{
+			checkAutoTrim();
+			foldOccupancy(cache, slot);
+			s_globalLock.lock();
+			ptr = depotPop(slot, bMiss);
 			s_globalLock.unlock();
-			if (nullptr == ptr)
-				ptr = malloc(allocSize);
 		}
-		if (nullptr == ptr)
+		return ptr;
+	}
+
+	// Put block to magazine or depot, return false if caller should free the block.
+	static inline bool cachePush(__thread_cache * const cache, const size_t slot, void * const ptr)
+	{
+		size_t capacity = magazineCapacity(slot);
+		if (cache != nullptr && capacity != 0)
+		{
+			__magazine& magazine = cache->m_magazines[slot];
+			if (magazine.m_count >= capacity)
+			{
+				foldOccupancy(cache, slot);
+				flushMagazine(magazine, slot, capacity / 2);
+			}
+			*(void **)ptr = magazine.m_head;
+			magazine.m_head = ptr;
+			++magazine.m_count;
+			return true;
+		}
+		checkAutoTrim();
+		foldOccupancy(cache, slot);
+		s_globalLock.lock();
+		bool bRet = depotPush(slot, ptr);
+		s_globalLock.unlock();
+		return bRet;
+	}
+
+	// User data at base + offset, header right before it.
+	static void *allocLarge(__thread_cache * const cache, const size_t size, const size_t offset)
+	{
+		size_t slot = s_largeHeaderSize == offset ? sizeToSlot(size) : s_slotNumber; // Block with bigger offset is not cached.
+		size_t blockSize;
+		void *base = nullptr;
+		__stat_type type = stat_miss;
+		if (slot < s_slotNumber)
+		{
+			blockSize = slotBlockSize(slot); // Round up to size class.
+			bool bMiss; // Large block is never carved.
+			if (s_maxAllocatorStoreNumber[slot] != 0 || s_allocatorStoreCount[slot] != 0) // Just a prob(Accurate calculate will hold the lock).
+				base = cachePop(cache, slot, bMiss);
+			if (base != nullptr)
+				type = stat_hit;
+			else
+				base = allocLargeMemory(slot);
+			if (base != nullptr && inArena(base))
+			{
+				recordStats(cache, slot, type, true, slotToSize(slot));
+				return base; // No header.
+			}
+		}
+		else
+		{
+			slot = s_hugeSlot;
+			blockSize = offset + size;
+			if (blockSize < size) // In case of overflow.
+			{
+				CA_FPRINTF((stderr, "malloc_no_throw size overflow.\n"));
+				std::terminate();
+			}
+			base = allocAlignedMemory(blockSize, offset);
+		}
+		if (nullptr == base)
 			return nullptr;
-		*(size_t *)ptr = allocSize;
-		++s_count;
-		s_size += allocSize;
+		__large *header = (__large *)((char *)base + offset) - 1;
+		header->m_slot = slot;
+		header->m_size = blockSize;
+		header->m_offset = offset;
+		recordStats(cache, slot, type, true, blockSize);
+		return (char *)base + offset;
+	}
+
+	void *__alloc(const size_t size)
+	{
+		initStoreNumber();
+		CA_FPRINTF((stderr, "fa alloc %u.\n", size));
+		__thread_cache *cache = t_threadCache.get();
+		size_t slot = sizeToSlot(size);
+		void *ptr;
+		if (slot >= s_slotNumber || isLargeSlot(slot))
+			ptr = allocLarge(cache, size, s_largeHeaderSize);
+		else
+		{
+			CA_FPRINTF((stderr, "fa alloc use store.\n"));
+			bool bMiss;
+			ptr = cachePop(cache, slot, bMiss); // Carved from slab when depot is empty.
+			if (ptr != nullptr)
+				recordStats(cache, slot, bMiss ? stat_miss : stat_hit, true, slotToSize(slot));
+		}
 	#if CA_DBG
-		memset((size_t *)ptr + 1, -1, size);
+		if (ptr != nullptr)
+			memset(ptr, -1, size);
 	#endif
-		return (size_t *)ptr + 1;
+		return ptr;
+	}
+
+	void *__alloc_aligned(const size_t size, const size_t alignment)
+	{
+		if (0 == alignment || (alignment & (alignment - 1)) != 0 || alignment >= s_slabSize)
+			return nullptr;
+		if (alignment <= s_largeHeaderSize)
+		{
+			// Slab block of size which is multiple of alignment is aligned, so is large block.
+			size_t alignedSize = (size + alignment - 1) & ~(alignment - 1);
+			if (alignedSize < size) // In case of overflow.
+			{
+				CA_FPRINTF((stderr, "malloc_no_throw size overflow.\n"));
+				std::terminate();
+			}
+			return __alloc(alignedSize);
+		}
+		initStoreNumber();
+		void *ptr = allocLarge(t_threadCache.get(), size, alignment);
+	#if CA_DBG
+		if (ptr != nullptr)
+			memset(ptr, -1, size);
+	#endif
+		return ptr;
 	}
 
 	void *__alloc_throw(const size_t size)
@@ -138,43 +1027,460 @@ namespace NETWORK_POOL
 		if (nullptr == ptr)
 			return;
 		CA_FPRINTF((stderr, "fa free.\n"));
-		void *org = (size_t *)ptr - 1;
-		size_t allocSize = *(size_t *)org;
-		size_t orgSize = allocSize - sizeof(size_t);
-		--s_count;
-		s_size -= allocSize;
+		__thread_cache *cache = t_threadCache.get();
+		void *base;
+		size_t slot;
+		size_t blockSize;
+		if (arenaRun(ptr, slot))
+		{
+			base = ptr;
+			blockSize = slotToSize(slot); // No header.
+		}
+		else if (inArena(ptr) || isSlabMemory(ptr))
+		{
+			slot = ((__slab *)((uintptr_t)ptr & ~(uintptr_t)(s_slabSize - 1)))->m_slot;
+			recordStats(cache, slot, stat_free_to_cache, false, slotToSize(slot));
+		#if CA_DBG
+			memset(ptr, -1, slotToSize(slot));
+		#endif
+			cachePush(cache, slot, ptr); // Always success.
+			return;
+		}
+		else
+		{
+			const __large *header = (const __large *)ptr - 1;
+			slot = header->m_slot;
+			blockSize = header->m_size;
+			base = (char *)ptr - header->m_offset;
+		}
 	#if CA_DBG
-		memset(org, -1, allocSize);
+		memset(base, -1, blockSize);
 	#endif
-		if (orgSize >= s_maxAllocatorSlot || 0 == s_maxAllocatorStoreNumber[orgSize])
-			return free(org);
+		if (slot >= s_slotNumber || 0 == s_maxAllocatorStoreNumber[slot])
+		{
+			recordStats(cache, slot, stat_free_to_os, false, blockSize);
+			return freeAlignedMemory(base);
+		}
 		CA_FPRINTF((stderr, "fa free use store.\n"));
+		if (cachePush(cache, slot, base))
+			recordStats(cache, slot, stat_free_to_cache, false, blockSize);
+		else
+		{
+			recordStats(cache, slot, stat_free_to_os, false, blockSize);
+			freeAlignedMemory(base);
+		}
+	}
+
+	size_t __register_slab(const size_t size)
+	{
+		initStoreNumber();
+		size_t stride = size < s_slabAlign ? s_slabAlign : (size + s_slabAlign - 1) & ~(s_slabAlign - 1);
+		if (stride > s_maxSlabBlockSize)
+			return (size_t)-1;
+		std::lock_guard<std::mutex> guard(s_globalLock);
+		size_t index = s_slabTypeCount;
+		if (index >= s_maxSlabNumber)
+			return (size_t)-1;
+		size_t slot = s_slotNumber + index;
+		__slab_type& type = s_slabTypes[slot];
+		type.m_size = size;
+		type.m_stride = stride;
+		type.m_blockNumber = (s_slabSize - s_slabHeaderSize) / stride;
+		type.m_partial = nullptr;
+		type.m_emptyCount = 0;
+		type.m_slabCount = 0;
+		// Inherit the limit of the size(Which set by initStoreNumber or __dynamic_set_cache).
+		size_t sizeSlot = sizeToSlot(size);
+		s_maxAllocatorStoreNumber[slot] = s_baseStoreNumber[slot] = sizeSlot < s_slotNumber ? s_baseStoreNumber[sizeSlot] : 0;
+		s_slabTypeCount = index + 1;
+		return slot;
+	}
+
+	void *__slab_alloc(const size_t slab, const size_t size)
+	{
+		if (slab < s_slotNumber || slab >= s_totalSlotNumber || size != s_slabTypes[slab].m_size)
+			return __alloc(size);
+		__thread_cache *cache = t_threadCache.get();
+		bool bMiss;
+		void *ptr = cachePop(cache, slab, bMiss);
+		if (nullptr == ptr)
+			return nullptr;
+		recordStats(cache, slab, bMiss ? stat_miss : stat_hit, true, size);
+	#if CA_DBG
+		memset(ptr, -1, size);
+	#endif
+		return ptr;
+	}
+
+	void *__slab_alloc_throw(const size_t slab, const size_t size)
+	{
+		void *ptr = __slab_alloc(slab, size);
+		if (nullptr == ptr)
+			throw std::bad_alloc();
+		return ptr;
+	}
+
+	// Call with s_globalLock held, and return the blocks which should be freed.
+	static void *shrinkDepot(const size_t slot, const size_t limit, void *head)
+	{
+		while (s_allocatorStoreCount[slot] > limit)
+		{
+			void *ptr = s_allocatorStore[slot];
+			s_allocatorStore[slot] = *(void **)ptr;
+			--s_allocatorStoreCount[slot];
+			if (!isLargeSlot(slot))
+				slabPush(slot, ptr);
+			else
+			{
+				*(void **)ptr = head;
+				head = ptr;
+			}
+		}
+		return head;
+	}
+
+	bool __dynamic_set_cache(const size_t size, const size_t cacheNumber)
+	{
+		size_t slot = sizeToSlot(size);
+		if (slot >= s_slotNumber)
+			return false;
 		s_globalLock.lock();
-		if (s_allocatorStoreCount[orgSize] < s_maxAllocatorStoreNumber[orgSize])
+		if (cacheNumber > s_baseStoreNumber[slot])
+			s_baseStoreNumber[slot] = cacheNumber;
+		if (cacheNumber > s_maxAllocatorStoreNumber[slot])
+			s_maxAllocatorStoreNumber[slot] = cacheNumber;
+		for (size_t index = 0; index < s_slabTypeCount; ++index)
 		{
-			*(void **)org = s_allocatorStore[orgSize];
-			s_allocatorStore[orgSize] = org;
-			++s_allocatorStoreCount[orgSize];
-			org = nullptr;
+			if (size != s_slabTypes[s_slotNumber + index].m_size)
+				continue;
+			if (cacheNumber > s_baseStoreNumber[s_slotNumber + index])
+				s_baseStoreNumber[s_slotNumber + index] = cacheNumber;
+			if (cacheNumber > s_maxAllocatorStoreNumber[s_slotNumber + index])
+				s_maxAllocatorStoreNumber[s_slotNumber + index] = cacheNumber;
 		}
 		s_globalLock.unlock();
-		free(org); // Free can deal with nullptr.
+		return true;
 	}
 
-	bool __dynamic_set_cache(const size_t size, const size_t cacheNumber)
+	bool __set_cache_limit(const size_t size, const size_t cacheNumber)
 	{
-		if (size >= s_maxAllocatorSlot)
+		size_t slot = sizeToSlot(size);
+		if (slot >= s_slotNumber)
 			return false;
+		initStoreNumber(); // Or the default may overwrite it.
+		void *head = nullptr;
 		s_globalLock.lock();
-		if (cacheNumber > s_maxAllocatorStoreNumber[size])
-			s_maxAllocatorStoreNumber[size] = cacheNumber;
+		s_maxAllocatorStoreNumber[slot] = s_baseStoreNumber[slot] = cacheNumber;
+		head = shrinkDepot(slot, cacheNumber, head); // Release the blocks over limit.
+		for (size_t index = 0; index < s_slabTypeCount; ++index)
+		{
+			if (size == s_slabTypes[s_slotNumber + index].m_size)
+			{
+				s_maxAllocatorStoreNumber[s_slotNumber + index] = s_baseStoreNumber[s_slotNumber + index] = cacheNumber;
+				shrinkDepot(s_slotNumber + index, cacheNumber, nullptr);
+			}
+		}
 		s_globalLock.unlock();
+		while (head != nullptr)
+		{
+			void *next = *(void **)head;
+			freeAlignedMemory(head);
+			head = next;
+		}
 		return true;
 	}
 
+	// Close the epoch, return the bytes released.
+	static size_t trimDepot()
+	{
+		size_t released = 0;
+		void *head = nullptr;
+		s_globalLock.lock();
+		size_t slotEnd = s_slotNumber + s_slabTypeCount;
+		for (size_t slot = 0; slot < slotEnd; ++slot)
+		{
+			size_t count = s_allocatorStoreCount[slot];
+			size_t idle = s_depotLow[slot] < count ? s_depotLow[slot] : count;
+			adaptDepot(slot);
+			size_t keep = count - idle;
+			if (keep > s_maxAllocatorStoreNumber[slot])
+				keep = s_maxAllocatorStoreNumber[slot];
+			if (isLargeSlot(slot) && !s_arenaSlot[slot])
+				released += (count - keep) * slotBlockSize(slot); // Small blocks go back to slabs.
+			head = shrinkDepot(slot, keep, head);
+			s_depotLow[slot] = s_allocatorStoreCount[slot];
+		}
+		// Release all empty slabs(Blocks in magazine are counted as used).
+		for (size_t slot = 0; slot < slotEnd; ++slot)
+		{
+			__slab_type& type = s_slabTypes[slot];
+			__slab *slab = type.m_partial;
+			while (slab != nullptr)
+			{
+				__slab *next = slab->m_next;
+				if (0 == slab->m_used)
+				{
+					unlinkSlab(type, slab);
+					--type.m_slabCount;
+					--type.m_emptyCount;
+					if (!inArena(slab))
+						released += s_slabSize;
+					freeSlabMemory(slab);
+				}
+				slab = next;
+			}
+		}
+		s_globalLock.unlock();
+		while (head != nullptr)
+		{
+			void *next = *(void **)head;
+			freeAlignedMemory(head);
+			head = next;
+		}
+		return released;
+	}
+
+	size_t __trim_cache()
+	{
+		initStoreNumber();
+		// Other thread's magazine can only be returned by itself.
+		__thread_cache *cache = t_threadCache.get();
+		if (cache != nullptr)
+		{
+			for (size_t slot = 0; slot < s_totalSlotNumber; ++slot)
+				flushMagazine(cache->m_magazines[slot], slot, cache->m_magazines[slot].m_count);
+		}
+		return trimDepot();
+	}
+
+	void __set_auto_trim(const unsigned int intervalInSeconds)
+	{
+		s_trimInterval = (uint64_t)intervalInSeconds * 1000;
+		s_nextTrim = 0 == intervalInSeconds ? 0 : nowInMs() + s_trimInterval;
+	}
+
+	void __set_adaptive_cache(const bool bAdaptive)
+	{
+		initStoreNumber();
+		std::lock_guard<std::mutex> guard(s_globalLock);
+		s_bAdaptive = bAdaptive;
+		if (!bAdaptive)
+		{
+			// Back to the limit set by user.
+			for (size_t slot = 0; slot < s_slotNumber + s_slabTypeCount; ++slot)
+				s_maxAllocatorStoreNumber[slot] = s_baseStoreNumber[slot];
+		}
+	}
+
+	// Fill the depot of slot up to min(limit, number), return the number of blocks added.
+	static size_t prefillSlot(const size_t slot, const size_t number, const bool bTouch)
+	{
+		size_t blockSize = slotBlockSize(slot);
+		bool bLarge = isLargeSlot(slot);
+		void *head = nullptr;
+		s_globalLock.lock();
+		size_t limit = s_maxAllocatorStoreNumber[slot] < number ? s_maxAllocatorStoreNumber[slot] : number;
+		size_t need = s_allocatorStoreCount[slot] < limit ? limit - s_allocatorStoreCount[slot] : 0;
+		if (!bLarge)
+		{
+			bool bCarved;
+			for (size_t i = 0; i < need; ++i)
+			{
+				void *ptr = slabPop(slot, bCarved);
+				if (nullptr == ptr)
+					break;
+				*(void **)ptr = head;
+				head = ptr;
+			}
+		}
+		s_globalLock.unlock();
+		if (bLarge)
+		{
+			for (size_t i = 0; i < need; ++i)
+			{
+				void *ptr = allocLargeMemory(slot);
+				if (nullptr == ptr)
+					break;
+				*(void **)ptr = head;
+				head = ptr;
+			}
+		}
+		// Fault in the pages outside the lock.
+		if (bTouch)
+		{
+			for (void *ptr = head; ptr != nullptr; ptr = *(void **)ptr)
+				memset((void **)ptr + 1, 0, (inArena(ptr) ? slotToSize(slot) : blockSize) - sizeof(void *)); // No header in arena.
+		}
+		size_t filled = 0;
+		void *rest = nullptr;
+		s_globalLock.lock();
+		while (head != nullptr)
+		{
+			void *next = *(void **)head;
+			if (s_allocatorStoreCount[slot] < s_maxAllocatorStoreNumber[slot])
+			{
+				*(void **)head = s_allocatorStore[slot];
+				s_allocatorStore[slot] = head;
+				++s_allocatorStoreCount[slot];
+				++filled;
+			}
+			else if (!bLarge)
+				slabPush(slot, head); // Someone else filled it.
+			else
+			{
+				*(void **)head = rest;
+				rest = head;
+			}
+			head = next;
+		}
+		s_globalLock.unlock();
+		while (rest != nullptr)
+		{
+			void *next = *(void **)rest;
+			freeAlignedMemory(rest);
+			rest = next;
+		}
+		return filled;
+	}
+
+	size_t __prefill_cache(const size_t size, const size_t number, const bool bTouch)
+	{
+		initStoreNumber();
+		size_t slot = sizeToSlot(size);
+		if (slot >= s_slotNumber)
+			return 0;
+		size_t filled = prefillSlot(slot, number, bTouch);
+		for (size_t index = 0; index < s_slabTypeCount; ++index)
+		{
+			if (size == s_slabTypes[s_slotNumber + index].m_size)
+				filled += prefillSlot(s_slotNumber + index, number, bTouch);
+		}
+		return filled;
+	}
+
+	size_t __prefill_slab(const size_t slab, const size_t number, const bool bTouch)
+	{
+		if (slab < s_slotNumber || slab >= s_slotNumber + s_slabTypeCount)
+			return 0;
+		return prefillSlot(slab, number, bTouch);
+	}
+
+	bool __enable_huge_arena(const size_t size, const bool bHugeTlb)
+	{
+	#ifdef __linux__
+		std::lock_guard<std::mutex> guard(s_arenaLock);
+		if (s_arenaBase != nullptr)
+			return false;
+		size_t arenaSize = (size + s_hugePageSize - 1) & ~(s_hugePageSize - 1);
+		if (0 == arenaSize)
+			return false;
+		char *base = nullptr;
+	#ifdef MAP_HUGETLB
+		if (bHugeTlb)
+		{
+			// Need huge pages reserved in /proc/sys/vm/nr_hugepages.
+			void *ptr = mmap(nullptr, arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (ptr != MAP_FAILED)
+				base = (char *)ptr;
+		}
+	#endif
+		if (nullptr == base)
+		{
+			// Align to huge page so transparent huge page can back the whole arena.
+			size_t mapSize = arenaSize + s_hugePageSize;
+			void *ptr = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (MAP_FAILED == ptr)
+				return false;
+			base = (char *)(((uintptr_t)ptr + s_hugePageSize - 1) & ~(uintptr_t)(s_hugePageSize - 1));
+			if (base != ptr)
+				munmap(ptr, base - (char *)ptr);
+			if (base + arenaSize != (char *)ptr + mapSize)
+				munmap(base + arenaSize, (char *)ptr + mapSize - (base + arenaSize));
+		#ifdef MADV_HUGEPAGE
+			madvise(base, arenaSize, MADV_HUGEPAGE); // Best effort.
+		#endif
+		}
+		__arena_page *map = (__arena_page *)calloc(arenaSize / s_slabSize, sizeof(__arena_page));
+		if (nullptr == map)
+		{
+			munmap(base, arenaSize);
+			return false;
+		}
+		s_arenaMap = map;
+		s_arenaTop = base;
+		s_arenaEnd.store(base + arenaSize, std::memory_order_release);
+		s_arenaBase.store(base, std::memory_order_release);
+		return true;
+	#else
+		return false;
+	#endif
+	}
+
+	size_t __use_huge_arena(const size_t minSize, const size_t maxSize)
+	{
+		size_t number = 0;
+		if (nullptr == s_arenaBase)
+			return number;
+		size_t minSlot = sizeToSlot(minSize);
+		size_t maxSlot = sizeToSlot(maxSize);
+		std::lock_guard<std::mutex> guard(s_globalLock);
+		for (size_t slot = minSlot; slot <= maxSlot && slot < s_slotNumber; ++slot)
+		{
+			// Large class smaller than a chunk wastes too much.
+			if (!isLargeSlot(slot) || slotToSize(slot) >= s_slabSize)
+			{
+				s_arenaSlot[slot] = true;
+				++number;
+			}
+		}
+		return number;
+	}
+
+	size_t __cache_block_size(const size_t size)
+	{
+		size_t slot = sizeToSlot(size);
+		return slot >= s_slotNumber ? size : slotToSize(slot);
+	}
+
 	void __get_usage_data(size_t& count, size_t& size)
 	{
-		count = s_count;
-		size = s_size;
+		s_globalLock.lock();
+		count = s_sharedCount.load(std::memory_order_relaxed);
+		size = s_sharedBytes.load(std::memory_order_relaxed);
+		for (__thread_cache *cache = s_threadCaches; cache != nullptr; cache = cache->m_next)
+		{
+			count += cache->m_count.load(std::memory_order_relaxed);
+			size += cache->m_bytes.load(std::memory_order_relaxed);
+		}
+		s_globalLock.unlock();
+	}
+
+	void __get_cache_stats(std::vector<__cache_stats>& stats)
+	{
+		stats.clear();
+		std::lock_guard<std::mutex> guard(s_globalLock);
+		for (size_t slot = 0; slot < s_statSlotNumber; ++slot)
+		{
+			if (slot >= s_slotNumber + s_slabTypeCount && slot != s_hugeSlot)
+				continue; // Slab not registered.
+			size_t counter[stat_number];
+			sumStats(slot, counter);
+			if (0 == counter[stat_hit] + counter[stat_miss])
+				continue;
+			__cache_stats item;
+			item.bSlab = slot >= s_slotNumber && slot != s_hugeSlot; // Registered slab.
+			item.blockSize = slot != s_hugeSlot ? slotToSize(slot) : 0;
+			item.hit = counter[stat_hit];
+			item.miss = counter[stat_miss];
+			item.freeToCache = counter[stat_free_to_cache];
+			item.freeToOs = counter[stat_free_to_os];
+			item.occupancy = counter[stat_hit] + counter[stat_miss] - counter[stat_free_to_cache] - counter[stat_free_to_os];
+			item.highWater = s_highWater[slot].load(std::memory_order_relaxed);
+			if ((ptrdiff_t)item.occupancy > 0 && item.occupancy > item.highWater)
+				item.highWater = item.occupancy; // Not folded yet.
+			item.cached = slot != s_hugeSlot ? s_allocatorStoreCount[slot] : 0;
+			item.cacheLimit = slot != s_hugeSlot ? s_maxAllocatorStoreNumber[slot] : 0;
+			stats.push_back(item);
+		}
 	}
 }
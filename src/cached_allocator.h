@@ -22,16 +22,66 @@
 #pragma once
 
 #include <cstddef>
+#include <vector>
 
 namespace NETWORK_POOL
 {
+	// No header before small block(Large block has one), user pointer is at least 16 bytes aligned.
 	void *__alloc(const size_t size);
 	void *__alloc_throw(const size_t size);
+	// Alignment should be power of 2 and smaller than 64KB, return nullptr if not. Freed by __free.
+	void *__alloc_aligned(const size_t size, const size_t alignment);
 	void __free(void * const ptr);
 
-	bool __dynamic_set_cache(const size_t size, const size_t cacheNumber);
+	// Size below 4KB is rounded up to 16 bytes, and size in [4KB, 1MB] is rounded up to size class.
+	bool __dynamic_set_cache(const size_t size, const size_t cacheNumber); // Only enlarge.
+	bool __set_cache_limit(const size_t size, const size_t cacheNumber); // Set the limit of size class(Release the blocks over limit).
+	size_t __cache_block_size(const size_t size); // Real block size when allocate 'size'.
+
+	// Fill the cache of size(And the slabs of this size) up to its limit at startup, so first burst need no malloc.
+	// Touch the memory if bTouch is true to fault in the pages. Return the number of blocks added.
+	size_t __prefill_cache(const size_t size, const size_t number = (size_t)-1, const bool bTouch = true);
 	void __get_usage_data(size_t& count, size_t& size);
 
+	// Each trim closes an epoch, blocks which sat in the cache for the whole epoch and empty slabs are released to the OS.
+	// With adaptive limit, a size's limit grows when it keeps missing and overflowing in an epoch, and shrinks when its blocks sit unused.
+	// Busy size also closes its epoch on the slow path every 1024 cache operations, so the limit adapts without trim.
+	// Adaptive limit stays in [limit / 4, limit * 4] of the limit set by user.
+	size_t __trim_cache(); // Also return the magazines of calling thread to the cache. Return the bytes released.
+	void __set_auto_trim(const unsigned int intervalInSeconds); // Trim on the slow path every interval, 0 to disable(Default).
+	void __set_adaptive_cache(const bool bAdaptive); // Default true, false restores the limits set by user.
+
+	struct __cache_stats
+	{
+		bool bSlab;
+		size_t blockSize; // 0 for block bigger than 1MB(Never cached).
+		size_t hit; // Allocate from cache.
+		size_t miss; // Allocate from system(Or carve from slab).
+		size_t freeToCache;
+		size_t freeToOs;
+		size_t occupancy; // Blocks in use.
+		size_t highWater; // High-water mark of occupancy(May lag a magazine per thread).
+		size_t cached; // Blocks in depot(Not include the thread local magazine).
+		size_t cacheLimit; // Current limit(May be adapted).
+	};
+	// Snapshot of every size class or slab which has been used.
+	void __get_cache_stats(std::vector<__cache_stats>& stats);
+
+	// Huge page arena for buffer(Linux only), reserve 'size' bytes(Rounded up to 2MB) once.
+	// Try MAP_HUGETLB first when bHugeTlb is true(Need reserved huge pages), else or on failure use transparent huge page(madvise).
+	// Memory in arena is reused but never returned to the OS. Return false if not supported or already enabled.
+	bool __enable_huge_arena(const size_t size, const bool bHugeTlb = false);
+	// Slabs of small size and blocks of class no smaller than 64KB in [minSize, maxSize] come from the arena while it has room.
+	// Call after __enable_huge_arena, return the number of size classes which use the arena.
+	size_t __use_huge_arena(const size_t minSize, const size_t maxSize);
+
+	// Slab for hot object type, return slab id or (size_t)-1 when fail.
+	// Blocks of the slab are carved from 64KB slabs, and can be freed by __free.
+	size_t __register_slab(const size_t size);
+	void *__slab_alloc(const size_t slab, const size_t size); // Fallback to __alloc when slab is invalid or size mismatch.
+	void *__slab_alloc_throw(const size_t slab, const size_t size);
+	size_t __prefill_slab(const size_t slab, const size_t number = (size_t)-1, const bool bTouch = true);
+
 	class CcachedAllocator
 	{
 	public:
@@ -62,4 +112,50 @@ namespace NETWORK_POOL
 			__free(ptr);
 		}
 	};
+
+	// Derive from CslabAllocator<T> instead of CcachedAllocator to let T own a slab.
+	template<class T>
+	class CslabAllocator : public CcachedAllocator
+	{
+	private:
+		static size_t slab()
+		{
+			static const size_t s_slab = __register_slab(sizeof(T));
+			return s_slab;
+		}
+
+	public:
+		static size_t prefill(const size_t number = (size_t)-1, const bool bTouch = true)
+		{
+			return __prefill_slab(slab(), number, bTouch);
+		}
+
+		void *operator new(size_t size)
+		{
+			return __slab_alloc_throw(slab(), size); // Derived class with different size fallback to __alloc.
+		}
+		void *operator new(size_t size, const std::nothrow_t& nothrow_value)
+		{
+			return __slab_alloc(slab(), size);
+		}
+
+		// Pair with new above(Declaring any hides all inherited), __free knows the slab block.
+		void operator delete(void *ptr)
+		{
+			__free(ptr);
+		}
+		void operator delete(void *ptr, const std::nothrow_t& nothrow_constant)
+		{
+			__free(ptr);
+		}
+		// For C++14.
+		void operator delete(void *ptr, size_t size)
+		{
+			__free(ptr);
+		}
+		void operator delete(void *ptr, size_t size, const std::nothrow_t& nothrow_constant)
+		{
+			__free(ptr);
+		}
+	};
 }
@@ -33,7 +33,7 @@
 
 namespace NETWORK_POOL
 {
-	class ChttpContext : public CrecvBuffer, public CcachedAllocator
+	class ChttpContext : public CrecvBuffer, public CslabAllocator<ChttpContext>
 	{
 	private:
 		std::mutex m_contextLock;
@@ -143,6 +143,12 @@ namespace NETWORK_POOL
 			return m_contextLock;
 		}
 
+		void recycle()
+		{
+			CrecvBuffer::recycle();
+			m_state = state_uninit; // Vectors are cleared and keep capacity when init.
+		}
+
 		bool analysis()
 		{
 			if (CrecvBuffer::bOverflow())
@@ -27,6 +27,7 @@
 #include "cached_allocator.h"
 #include "http_context.h"
 #include "mt_shared_ptr.h"
+#include "object_pool.h"
 #include "work_queue.h"
 
 namespace NETWORK_POOL
@@ -59,7 +60,7 @@ namespace NETWORK_POOL
 						// Deal with the request.
 
 						static const std::string resp("HTTP/1.1 200 OK\r\nConnection:Keep-Alive\r\nContent-Length: 10\r\n\r\n0123456789");
-						m_pool.sendTcp(m_socketId, resp.data(), resp.length());
+						m_pool.sendTcp(m_socketId, Cbuffer::borrow(resp.data(), resp.length())); // Static, no copy.
 						if (!m_context->isKeepAlive())
 						{
 							m_pool.close(m_socketId);
@@ -76,7 +77,7 @@ namespace NETWORK_POOL
 		}
 	};
 
-	class ChttpSession : public CtcpCallback, public CcachedAllocator
+	class ChttpSession : public CtcpCallback, public CslabAllocator<ChttpSession>
 	{
 	private:
 		preferred_tcp_settings m_defaultSettings;
@@ -118,7 +119,7 @@ namespace NETWORK_POOL
 		void startup(const socket_id socketId, const Csockaddr& remote)
 		{
 			m_socketId = socketId;
-			m_context.reset(new ChttpContext());
+			m_context = CobjectPool<ChttpContext>::acquireShared(); // Recycled with its buffer.
 		}
 		void shutdown()
 		{
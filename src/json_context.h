@@ -28,7 +28,7 @@
 
 namespace NETWORK_POOL
 {
-	class CjsonContext : public CrecvBuffer, public CcachedAllocator
+	class CjsonContext : public CrecvBuffer, public CslabAllocator<CjsonContext>
 	{
 	private:
 		std::mutex m_contextLock;
@@ -65,6 +65,12 @@ namespace NETWORK_POOL
 			return m_contextLock;
 		}
 
+		void recycle()
+		{
+			CrecvBuffer::recycle();
+			init();
+		}
+
 		bool analysis()
 		{
 			char *ptr = (char *)CrecvBuffer::buffer().getData();
@@ -27,6 +27,7 @@
 #include "cached_allocator.h"
 #include "json_context.h"
 #include "mt_shared_ptr.h"
+#include "object_pool.h"
 #include "work_queue.h"
 
 namespace NETWORK_POOL
@@ -80,7 +81,7 @@ namespace NETWORK_POOL
 		}
 	};
 
-	class CjsonSession : public CtcpCallback, public CcachedAllocator
+	class CjsonSession : public CtcpCallback, public CslabAllocator<CjsonSession>
 	{
 	private:
 		preferred_tcp_settings m_defaultSettings;
@@ -122,7 +123,7 @@ namespace NETWORK_POOL
 		void startup(const socket_id socketId, const Csockaddr& remote)
 		{
 			m_socketId = socketId;
-			m_context.reset(new CjsonContext());
+			m_context = CobjectPool<CjsonContext>::acquireShared(); // Recycled with its buffer.
 		}
 		void shutdown()
 		{
@@ -27,7 +27,14 @@
 
 namespace NETWORK_POOL
 {
-	class CatomicCounter : public std::atomic<size_t>, public CcachedAllocator {};
+	class CatomicCounter : public std::atomic<size_t>, public CcachedAllocator
+	{
+	public:
+		void (*m_release)(void *); // Release the object instead of delete when set.
+
+		CatomicCounter(void (*release)(void *) = nullptr)
+			:std::atomic<size_t>(0), m_release(release) {}
+	};
 
 	template<class T>
 	class CmtSharedPtr : public CcachedAllocator
@@ -36,10 +43,22 @@ namespace NETWORK_POOL
 		CatomicCounter *m_count;
 		T* m_ptr;
 
+		inline void unref()
+		{
+			if (m_count != nullptr && 0 == --*m_count)
+			{
+				if (m_count->m_release != nullptr)
+					m_count->m_release(m_ptr);
+				else
+					delete m_ptr;
+				delete m_count;
+			}
+		}
+
 	public:
 		CmtSharedPtr()
 			:m_count(nullptr), m_ptr(nullptr) {}
-		CmtSharedPtr(T *ptr)
+		CmtSharedPtr(T *ptr, void (*release)(void *) = nullptr)
 		{
 			if (nullptr == ptr)
 			{
@@ -48,7 +67,7 @@ namespace NETWORK_POOL
 			}
 			else
 			{
-				m_count = new CatomicCounter();
+				m_count = new CatomicCounter(release);
 				m_ptr = ptr;
 				++*m_count;
 			}
@@ -67,40 +86,30 @@ namespace NETWORK_POOL
 		}
 		~CmtSharedPtr()
 		{
-			if (m_count != nullptr && 0 == --*m_count)
-			{
-				delete m_count;
-				delete m_ptr;
-			}
+			unref();
 		}
 
 		const CmtSharedPtr& operator=(const CmtSharedPtr& another)
 		{
 			// Remove old.
-			if (m_count != nullptr && 0 == --*m_count)
-			{
-				delete m_count;
-				delete m_ptr;
-			}
+			unref();
 			// Copy new.
 			m_count = another.m_count;
 			m_ptr = another.m_ptr;
 			if (m_count != nullptr)
 				++*m_count;
+			return *this;
 		}
 		const CmtSharedPtr& operator=(CmtSharedPtr&& another)
 		{
 			// Remove old.
-			if (m_count != nullptr && 0 == --*m_count)
-			{
-				delete m_count;
-				delete m_ptr;
-			}
+			unref();
 			// Move new.
 			m_count = another.m_count;
 			m_ptr = another.m_ptr;
 			another.m_count = nullptr;
 			another.m_ptr = nullptr;
+			return *this;
 		}
 
 		T& operator*()
@@ -130,14 +139,10 @@ namespace NETWORK_POOL
 			return 1 == *m_count;
 		}
 
-		void reset(T *ptr = nullptr)
+		void reset(T *ptr = nullptr, void (*release)(void *) = nullptr)
 		{
 			// Remove old.
-			if (m_count != nullptr && 0 == --*m_count)
-			{
-				delete m_count;
-				delete m_ptr;
-			}
+			unref();
 			// allocate new.
 			if (nullptr == ptr)
 			{
@@ -146,7 +151,7 @@ namespace NETWORK_POOL
 			}
 			else
 			{
-				m_count = new CatomicCounter();
+				m_count = new CatomicCounter(release);
 				m_ptr = ptr;
 				++*m_count;
 			}
@@ -54,6 +54,10 @@ namespace NETWORK_POOL
 		{
 			return true;
 		}
+
+		// Backpressure notify by the watermarks in settings, pause sending after writeBlocked until writable.
+		virtual void writeBlocked(const size_t queuedBytes) {}
+		virtual void writable(const size_t queuedBytes) {}
 	};
 
 	class CudpCallback
@@ -19,33 +19,225 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
+
 #include "network_pool.h"
 #include "cached_allocator.h"
 #include "np_dbg.h"
 
+#ifdef __linux__
+	#include <sys/sendfile.h>
+#endif
+#ifdef NP_ZEROCOPY
+	#include <netinet/in.h>
+	#include <linux/errqueue.h>
+#endif
+
 #define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
 #define on_uv_error_goto_label(_expr, _str, _label) if ((_expr) != 0) { NP_FPRINTF(_str); goto _label; }
 #define goto_label(_str, _label) { NP_FPRINTF(_str); goto _label; }
 
 namespace NETWORK_POOL
 {
+	// Single buffer write is the common case, so give it a slab.
+	static inline size_t writeInfoSlab()
+	{
+		static const size_t s_slab = __register_slab(sizeof(CnetworkPool::__write_with_info) + sizeof(__buffer_release));
+		return s_slab;
+	}
+
+	// Release of each buffer follows the buffers.
+	static inline __buffer_release *writeRelease(CnetworkPool::__write_with_info * const writeInfo)
+	{
+		return (__buffer_release *)(writeInfo->buf + writeInfo->num);
+	}
+	static inline __buffer_release *udpSendRelease(CnetworkPool::__udp_send_with_info * const udpSendInfo)
+	{
+		return (__buffer_release *)(udpSendInfo->buf + udpSendInfo->num);
+	}
+
+#ifdef NP_ZEROCOPY
+	// Buffer partly sent with zerocopy is held by both the kernel and the write of the rest.
+	struct __shared_release
+	{
+		int count;
+		uv_buf_t buf;
+		__buffer_release release;
+	};
+	static void releaseShared(void *context)
+	{
+		__shared_release *shared = (__shared_release *)context;
+		if (0 == --shared->count)
+		{
+			__release_buffer(shared->buf, shared->release);
+			__free(shared);
+		}
+	}
+#endif
+
+	// Listeners of a group share the callback of user, and only the one on main reports startup and shutdown.
+	class CsharedTcpServerCallback : public CtcpServerCallback, public CcachedAllocator
+	{
+	private:
+		std::shared_ptr<CtcpServerCallback> m_callback;
+		bool m_bMain;
+
+	public:
+		CsharedTcpServerCallback(const std::shared_ptr<CtcpServerCallback>& callback, const bool bMain)
+			:m_callback(callback), m_bMain(bMain) {}
+
+		const preferred_tcp_server_settings& getSettings() override
+		{
+			return m_callback->getSettings();
+		}
+
+		CtcpCallback::ptr newTcpCallback() override
+		{
+			return m_callback->newTcpCallback();
+		}
+
+		void startup(const socket_id socketId, const Csockaddr& local) override
+		{
+			if (m_bMain)
+				m_callback->startup(socketId, local);
+		}
+		void shutdown() override
+		{
+			if (m_bMain)
+				m_callback->shutdown();
+		}
+
+		void listenError(const int err) override
+		{
+			m_callback->listenError(err);
+		}
+	};
+
 	//
 	// CnetworkPool
 	//
 
+	void __release_socket_id(CnetworkPool * const pool, const socket_id socketId)
+	{
+		if (pool != nullptr && socketId != SOCKET_ID_UNSPEC)
+			pool->m_slots.release(socketId);
+	}
+
+	size_t CnetworkPool::prefillCache(const size_t connectionNumber, const bool bTouch)
+	{
+		size_t filled = Ctcp::prefill(connectionNumber, bTouch);
+		filled += __prefill_slab(writeInfoSlab(), connectionNumber, bTouch);
+		return filled;
+	}
+
 	bool CnetworkPool::setTcpTimeout(Ctcp * const tcp, const unsigned int timeout_in_seconds)
 	{
 		if (0 == timeout_in_seconds)
-			return 0 == uv_timer_stop(tcp->getTimer());
-		else
 		{
-			return 0 == uv_timer_start(tcp->getTimer(),
+			tcp->setTimeoutDeadline(0);
+			tcp->getTimeoutNode()->unlink();
+			return true;
+		}
+		if (tcp->isClosing())
+			return false;
+		const uint64_t deadline = uv_now(&m_loop) + timeout_in_seconds * (uint64_t)1000;
+		tcp->setTimeoutDeadline(deadline);
+		// Later deadline is re-armed when the tick it waits for comes, only earlier one moves the node now.
+		__wheel_node *node = tcp->getTimeoutNode();
+		if (node->isLinked() && node->m_expire <= (deadline + s_wheelTickInMs - 1) / s_wheelTickInMs)
+			return true;
+		return wheelAdd(m_wheel, node, deadline);
+	}
+
+	bool CnetworkPool::wheelAdd(CtimingWheel& wheel, __wheel_node * const node, const uint64_t deadline)
+	{
+		if (!uv_is_active((const uv_handle_t *)&m_wheelTimer))
+		{
+			// Wheels are empty when the timer stops, so they start from now.
+			if (uv_timer_start(&m_wheelTimer,
 				[](uv_timer_t *handle)
 			{
-				Ctcp *tcp = Ctcp::obtain(handle);
-				if (tcp->getCallback()->timeout())
-					tcp->getPool()->shutdownTcpConnection(tcp);
-			}, timeout_in_seconds * 1000, 0);
+				((CnetworkPool *)handle->data)->expireTimeouts();
+			}, s_wheelTickInMs, s_wheelTickInMs) != 0)
+				return false;
+			m_wheel.reset(uv_now(&m_loop) / s_wheelTickInMs);
+			m_taskWheel.reset(uv_now(&m_loop) / s_wheelTickInMs);
+		}
+		wheel.add(node, (deadline + s_wheelTickInMs - 1) / s_wheelTickInMs); // Never expire before deadline.
+		return true;
+	}
+
+	bool CnetworkPool::addTimer(const timer_id timerId, const uint64_t delayInMs, Ctask::ptr&& task)
+	{
+		if (m_bWantExit)
+			return false;
+		__timer *timer;
+		try
+		{
+			timer = &m_timers[timerId];
+		}
+		catch (...)
+		{
+			NP_FPRINTF((stderr, "Schedule task error with insufficient memory.\n"));
+			return false;
+		}
+		timer->m_timerId = timerId;
+		timer->m_deadline = uv_now(&m_loop) + delayInMs;
+		timer->m_task = std::forward<Ctask::ptr>(task);
+		if (!wheelAdd(m_taskWheel, &timer->m_node, timer->m_deadline))
+		{
+			NP_FPRINTF((stderr, "Schedule task error with timer start error.\n"));
+			m_timers.erase(timerId);
+			return false;
+		}
+		return true;
+	}
+
+	bool CnetworkPool::cancelTimer(const timer_id timerId)
+	{
+		return m_timers.erase(timerId) != 0; // Unlinked by destructor.
+	}
+
+	void CnetworkPool::expireTimeouts()
+	{
+		const uint64_t now = uv_now(&m_loop);
+		m_wheel.advance(now / s_wheelTickInMs,
+			[this, now](__wheel_node * const node)
+		{
+			Ctcp *tcp = Ctcp::obtain(node);
+			const uint64_t deadline = tcp->getTimeoutDeadline();
+			if (0 == deadline)
+				return;
+			if (deadline > now)
+			{
+				m_wheel.add(node, (deadline + s_wheelTickInMs - 1) / s_wheelTickInMs); // Moved by activity.
+				return;
+			}
+			tcp->setTimeoutDeadline(0);
+			if (tcp->getCallback()->timeout())
+				shutdownTcpConnection(tcp);
+		});
+		m_taskWheel.advance(now / s_wheelTickInMs,
+			[this, now](__wheel_node * const node)
+		{
+			__timer *timer = container_of(node, __timer, m_node);
+			if (timer->m_deadline > now)
+			{
+				m_taskWheel.add(node, (timer->m_deadline + s_wheelTickInMs - 1) / s_wheelTickInMs); // Beyond the wheel.
+				return;
+			}
+			// Free the timer before run, so the task can schedule or cancel any.
+			Ctask::ptr task(std::move(timer->m_task));
+			const timer_id timerId = timer->m_timerId;
+			m_timers.erase(timerId);
+			task->run();
+		});
+		if (m_wheel.empty() && m_taskWheel.empty())
+		{
+			if (m_bWantExit)
+				uv_close((uv_handle_t *)&m_wheelTimer, nullptr);
+			else
+				uv_timer_stop(&m_wheelTimer);
 		}
 	}
 
@@ -53,6 +245,11 @@ namespace NETWORK_POOL
 	{
 		if (!setTcpTimeout(tcp, tcp->getCallback()->getTimeoutSettings().tcp_idle_timeout_in_seconds))
 			return false;
+		return tcpReadStart(tcp);
+	}
+
+	bool CnetworkPool::tcpReadStart(Ctcp * const tcp)
+	{
 		return 0 == uv_read_start(tcp->getStream(),
 			[](uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
 		{
@@ -77,8 +274,12 @@ namespace NETWORK_POOL
 				// Report message.
 				tcp->getCallback()->packet(buf->base, nread);
 				tcp->getCallback()->deallocateForPacket(buf->base, buf->len, nread);
-				// Reset idle close.
-				if (!tcp->isClosing() && !tcp->isShutdown() && 0 == uv_stream_get_write_queue_size(tcp->getStream()))
+				// Reset idle close, but a file in flight is limited by send timeout.
+				if (!tcp->isClosing() && !tcp->isShutdown() && 0 == uv_stream_get_write_queue_size(tcp->getStream())
+				#ifdef __linux__
+					&& !tcp->isSendingFile()
+				#endif
+					)
 				{
 					if (!pool->setTcpTimeout(tcp, tcp->getCallback()->getTimeoutSettings().tcp_idle_timeout_in_seconds))
 						pool->shutdownTcpConnection(tcp);
@@ -98,27 +299,264 @@ namespace NETWORK_POOL
 		});
 	}
 
-	bool CnetworkPool::tcpWriteWithTimeout(Ctcp * const tcp, Cbuffer * const data, const size_t number)
+#ifdef NP_ZEROCOPY
+	bool CnetworkPool::zerocopyWrite(Ctcp * const tcp, uv_buf_t * const buf, __buffer_release * const release, const size_t number, size_t& taken)
+	{
+		__zerocopy_socket *zerocopy;
+		try
+		{
+			auto ib = m_zerocopy.insert(std::make_pair(tcp->getSocketId(), __zerocopy_socket()));
+			zerocopy = &ib.first->second;
+			if (ib.second)
+			{
+				zerocopy->m_fd = -1;
+				zerocopy->m_nextSeq = 0;
+				zerocopy->m_closeDeadline = 0;
+				uv_os_fd_t fd;
+				const int enable = 1;
+				if (0 == uv_fileno((const uv_handle_t *)tcp->getTcp(), &fd) &&
+					0 == setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)))
+					zerocopy->m_fd = dup(fd); // Keep -1 if fail.
+			}
+		}
+		catch (...)
+		{
+			return false;
+		}
+		if (zerocopy->m_fd < 0)
+			return false;
+		// uv_buf_t is the same as iovec on unix.
+		static const size_t s_maxIov = 64;
+		taken = 0;
+		while (taken < number)
+		{
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = (iovec *)(buf + taken);
+			msg.msg_iovlen = std::min(number - taken, s_maxIov);
+			// Take all the memory before sendmsg, nothing may fail after the kernel holds the pages.
+			const size_t size = zerocopy->m_buffers.size();
+			__shared_release *shared = nullptr;
+			try
+			{
+				zerocopy->m_buffers.resize(size + msg.msg_iovlen);
+				shared = (__shared_release *)__alloc_throw(sizeof(__shared_release));
+			}
+			catch (...)
+			{
+				NP_FPRINTF((stderr, "Zerocopy tcp error with insufficient memory.\n"));
+				zerocopy->m_buffers.resize(size);
+				if (0 == taken)
+					return false; // Copy.
+				break;
+			}
+			const ssize_t sent = sendmsg(zerocopy->m_fd, &msg, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (sent <= 0)
+			{
+				zerocopy->m_buffers.resize(size);
+				__free(shared);
+				// Copy on ENOBUFS(Out of optmem) or other error(Reported by uv_write) when nothing sent.
+				if (0 == taken && !(sent < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)))
+					return false;
+				break;
+			}
+			const uint32_t seq = zerocopy->m_nextSeq++;
+			size_t left = (size_t)sent;
+			size_t used = size;
+			while (taken < number && left >= buf[taken].len)
+			{
+				left -= buf[taken].len;
+				zerocopy->m_buffers[used++] = __zerocopy_buffer{ seq, false, buf[taken], release[taken] };
+				++taken;
+			}
+			if (0 == left)
+			{
+				zerocopy->m_buffers.resize(used); // Shrink never throws.
+				__free(shared);
+				continue;
+			}
+			shared->count = 2;
+			shared->buf = buf[taken];
+			shared->release = release[taken];
+			zerocopy->m_buffers[used++] = __zerocopy_buffer{ seq, false, buf[taken], __buffer_release{ releaseShared, shared } };
+			zerocopy->m_buffers.resize(used);
+			release[taken] = __buffer_release{ releaseShared, shared };
+			buf[taken].base += left;
+			buf[taken].len -= left;
+			break; // Socket buffer is full.
+		}
+		if (!uv_is_active((const uv_handle_t *)&m_zerocopyTimer) && !zerocopy->m_buffers.empty())
+		{
+			uv_timer_start(&m_zerocopyTimer,
+				[](uv_timer_t *timer)
+			{
+				((CnetworkPool *)timer->data)->drainZerocopy();
+			}, 10, 10); // Never fail.
+		}
+		return true;
+	}
+
+	void CnetworkPool::drainZerocopy(const bool bExit)
+	{
+		bool bPending = false;
+		for (auto it = m_zerocopy.begin(); it != m_zerocopy.end();)
+		{
+			__zerocopy_socket& zerocopy = it->second;
+			// Each completion covers sendmsg in [ee_info, ee_data].
+			while (!bExit && zerocopy.m_fd >= 0 && !zerocopy.m_buffers.empty())
+			{
+				char control[128];
+				msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_control = control;
+				msg.msg_controllen = sizeof(control);
+				if (recvmsg(zerocopy.m_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+					break;
+				for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+				{
+					if (!(SOL_IP == cmsg->cmsg_level && IP_RECVERR == cmsg->cmsg_type) &&
+						!(SOL_IPV6 == cmsg->cmsg_level && IPV6_RECVERR == cmsg->cmsg_type))
+						continue;
+					const sock_extended_err *err = (const sock_extended_err *)CMSG_DATA(cmsg);
+					if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+						continue;
+					for (auto& buffer : zerocopy.m_buffers)
+					{
+						if ((int32_t)(buffer.m_seq - err->ee_info) >= 0 && (int32_t)(err->ee_data - buffer.m_seq) >= 0)
+							buffer.m_bDone = true;
+					}
+				}
+			}
+			while (!zerocopy.m_buffers.empty() && zerocopy.m_buffers.front().m_bDone)
+			{
+				__release_buffer(zerocopy.m_buffers.front().m_buf, zerocopy.m_buffers.front().m_release);
+				zerocopy.m_buffers.pop_front();
+			}
+			if (bExit || (zerocopy.m_closeDeadline != 0 && (zerocopy.m_buffers.empty() || uv_now(&m_loop) >= zerocopy.m_closeDeadline)))
+			{
+				if (!zerocopy.m_buffers.empty())
+				{
+					// Reset the connection so kernel drops the pages before release.
+					if (zerocopy.m_fd >= 0)
+					{
+						const linger reset = { 1, 0 };
+						setsockopt(zerocopy.m_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+					}
+					NP_FPRINTF((stderr, "Zerocopy tcp reset with %zu buffer(s) not completed.\n", zerocopy.m_buffers.size()));
+				}
+				if (zerocopy.m_fd >= 0)
+					::close(zerocopy.m_fd);
+				for (const auto& buffer : zerocopy.m_buffers)
+					__release_buffer(buffer.m_buf, buffer.m_release);
+				it = m_zerocopy.erase(it);
+				continue;
+			}
+			if (!zerocopy.m_buffers.empty())
+				bPending = true;
+			++it;
+		}
+		if (!bPending)
+			uv_timer_stop(&m_zerocopyTimer);
+	}
+
+	void CnetworkPool::closeZerocopy(Ctcp * const tcp, const bool bForce)
+	{
+		auto it = m_zerocopy.find(tcp->getSocketId());
+		if (it == m_zerocopy.end())
+			return;
+		__zerocopy_socket& zerocopy = it->second;
+		if (zerocopy.m_buffers.empty())
+		{
+			// Nothing held, the duplicated fd goes now.
+			if (zerocopy.m_fd >= 0)
+				::close(zerocopy.m_fd);
+			m_zerocopy.erase(it);
+			return;
+		}
+		// Socket lives with the duplicated fd until completion, or reset after send timeout(60 seconds if no timeout).
+		if (bForce)
+			shutdown(zerocopy.m_fd, SHUT_RDWR); // FIN after the data sent.
+		const unsigned int timeout = tcp->getCallback()->getTimeoutSettings().tcp_send_timeout_in_seconds;
+		zerocopy.m_closeDeadline = uv_now(&m_loop) + (0 == timeout ? 60 : timeout) * (uint64_t)1000;
+	}
+#endif
+
+	bool CnetworkPool::tcpWriteWithTimeout(Ctcp * const tcp, uv_buf_t * const buf, __buffer_release * const release, const size_t number)
 	{
-		__write_with_info *writeInfo = (__write_with_info *)__alloc(sizeof(__write_with_info) + sizeof(uv_buf_t) * (number - 1));
+		// Try to write at once when nothing is queued(No request and no callback if all written).
+		// All written is a write completion, so idle timeout restarts like in the write callback(Only a deadline in wheel).
+		size_t first = 0;
+		size_t offset = 0; // Written bytes of the first one left.
+		if (0 == uv_stream_get_write_queue_size(tcp->getStream()))
+		{
+		#ifdef NP_ZEROCOPY
+			// Large data goes without copy, the buffers are held until completion.
+			const size_t threshold = tcp->getCallback()->getSettings().tcp_zerocopy_threshold;
+			size_t total = 0;
+			for (size_t i = 0; threshold != 0 && i < number && total < threshold; ++i)
+				total += buf[i].len;
+			if (threshold != 0 && total >= threshold && zerocopyWrite(tcp, buf, release, number, first))
+			{
+				if (first == number)
+					return setTcpTimeout(tcp, tcp->getCallback()->getTimeoutSettings().tcp_idle_timeout_in_seconds);
+				// Rest is queued, partly sent one keeps a shared release(No offset).
+			}
+			else
+		#endif
+			{
+				const int written = uv_try_write(tcp->getStream(), buf, (unsigned int)number);
+				if (written > 0)
+				{
+					size_t left = (size_t)written;
+					while (first < number && left >= buf[first].len)
+					{
+						left -= buf[first].len;
+						__release_buffer(buf[first], release[first]);
+						++first;
+					}
+					if (first == number)
+						return setTcpTimeout(tcp, tcp->getCallback()->getTimeoutSettings().tcp_idle_timeout_in_seconds);
+					offset = left;
+					buf[first].base += offset;
+					buf[first].len -= offset;
+				}
+				// Or EAGAIN, and other error is reported by uv_write.
+			}
+		}
+		uv_buf_t * const restBuf = buf + first;
+		const __buffer_release * const restRelease = release + first;
+		const size_t restNumber = number - first;
+		__write_with_info *writeInfo = (__write_with_info *)(1 == restNumber ?
+			__slab_alloc(writeInfoSlab(), sizeof(__write_with_info) + sizeof(__buffer_release)) :
+			__alloc(sizeof(__write_with_info) + sizeof(uv_buf_t) * (restNumber - 1) + sizeof(__buffer_release) * restNumber));
 		if (nullptr == writeInfo)
 		{
 			NP_FPRINTF((stderr, "Send tcp error with insufficient memory.\n"));
-			for (size_t i = 0; i < number; ++i)
-				tcp->getCallback()->drop(data[i].getData(), data[i].getLength());
+			for (size_t i = 0; i < restNumber; ++i)
+			{
+				tcp->getCallback()->drop(restBuf[i].base, restBuf[i].len);
+				__release_buffer(restBuf[i], restRelease[i], 0 == i ? offset : 0);
+			}
 			return false;
 		}
 		if (!setTcpTimeout(tcp, tcp->getCallback()->getTimeoutSettings().tcp_send_timeout_in_seconds))
 		{
 			NP_FPRINTF((stderr, "Send tcp error with set timer error.\n"));
-			for (size_t i = 0; i < number; ++i)
-				tcp->getCallback()->drop(data[i].getData(), data[i].getLength());
+			for (size_t i = 0; i < restNumber; ++i)
+			{
+				tcp->getCallback()->drop(restBuf[i].base, restBuf[i].len);
+				__release_buffer(restBuf[i], restRelease[i], 0 == i ? offset : 0);
+			}
 			__free(writeInfo);
 			return false;
 		}
-		writeInfo->num = number;
-		for (size_t i = 0; i < number; ++i)
-			data[i].transfer(writeInfo->buf[i]);
+		writeInfo->num = restNumber;
+		writeInfo->offset = offset;
+		for (size_t i = 0; i < restNumber; ++i)
+		{
+			writeInfo->buf[i] = restBuf[i];
+			writeRelease(writeInfo)[i] = restRelease[i];
+		}
 		if (uv_write(&writeInfo->write, tcp->getStream(), writeInfo->buf, (unsigned int)writeInfo->num,
 			[](uv_write_t *req, int status)
 		{
@@ -136,19 +574,31 @@ namespace NETWORK_POOL
 			}
 			else if (!tcp->isClosing() && !tcp->isShutdown() && 0 == uv_stream_get_write_queue_size(tcp->getStream()))
 			{
+			#ifdef __linux__
+				// The file waits for the data before it.
+				if (tcp->isSendingFile())
+				{
+					if (!pool->pollTcpFile(tcp))
+						pool->shutdownTcpConnection(tcp);
+				}
+				else
+			#endif
 				if (!pool->setTcpTimeout(tcp, tcp->getCallback()->getTimeoutSettings().tcp_idle_timeout_in_seconds))
 					pool->shutdownTcpConnection(tcp);
 			}
 			// Free write buffer.
 			for (size_t i = 0; i < writeInfo->num; ++i)
-				__free(writeInfo->buf[i].base);
+				__release_buffer(writeInfo->buf[i], writeRelease(writeInfo)[i], 0 == i ? writeInfo->offset : 0);
 			__free(writeInfo);
+			// Notify writable after the buffers are released.
+			if (0 == status && tcp->isWriteBlocked() && !tcp->isClosing())
+				pool->checkTcpWatermark(tcp);
 		}) != 0)
 		{
 			for (size_t i = 0; i < writeInfo->num; ++i)
 			{
 				tcp->getCallback()->drop(writeInfo->buf[i].base, writeInfo->buf[i].len);
-				__free(writeInfo->buf[i].base);
+				__release_buffer(writeInfo->buf[i], writeRelease(writeInfo)[i], 0 == i ? writeInfo->offset : 0);
 			}
 			__free(writeInfo);
 			return false;
@@ -156,11 +606,299 @@ namespace NETWORK_POOL
 		return true;
 	}
 	
-	CtcpServer::ptr CnetworkPool::bindAndListenTcp(const Csockaddr& local, CtcpServerCallback::ptr&& callback)
+	bool CnetworkPool::tcpCork(Ctcp * const tcp, Cbuffer * const data, const size_t number)
 	{
-		CtcpServer::ptr tcpServer = CtcpServer::alloc(this, &m_loop, std::forward<CtcpServerCallback::ptr>(callback), ++m_socketIdCounter);
-		if (!tcpServer)
-			goto_label((stderr, "Bind and listen tcp error with insufficient memory.\n"), _ec);
+		if (overBudget())
+		{
+			// Drop to keep memory in budget, and the connection must be shut down(A hole in the stream).
+			for (size_t i = 0; i < number; ++i)
+				tcp->getCallback()->drop(data[i].getData(), data[i].getLength());
+			return false;
+		}
+		std::vector<uv_buf_t>& cork = tcp->getCork();
+		std::vector<__buffer_release>& corkRelease = tcp->getCorkRelease();
+		try
+		{
+			if (cork.capacity() < cork.size() + number)
+				cork.reserve(std::max(cork.size() + number, cork.capacity() * 2));
+			if (corkRelease.capacity() < corkRelease.size() + number)
+				corkRelease.reserve(std::max(corkRelease.size() + number, corkRelease.capacity() * 2));
+			if (!tcp->isCorked())
+				m_corkedTcp.push_back(tcp->getSocketId());
+		}
+		catch (...)
+		{
+			NP_FPRINTF((stderr, "Cork tcp error with insufficient memory.\n"));
+			for (size_t i = 0; i < number; ++i)
+				tcp->getCallback()->drop(data[i].getData(), data[i].getLength());
+			return false;
+		}
+		for (size_t i = 0; i < number; ++i)
+		{
+			uv_buf_t buf;
+			__buffer_release release;
+			data[i].transfer(buf, release);
+			cork.push_back(buf);
+			corkRelease.push_back(release);
+			tcp->corkBytes() += buf.len;
+		}
+		if (!tcp->isCorked())
+		{
+			tcp->setCorked(true);
+			if (1 == m_corkedTcp.size())
+				uv_idle_start(&m_flushIdle, [](uv_idle_t *idle) {}); // Never fail.
+		}
+		if (!tcp->isWriteBlocked())
+			checkTcpWatermark(tcp);
+		return true;
+	}
+
+	void CnetworkPool::checkTcpWatermark(Ctcp * const tcp)
+	{
+		const preferred_tcp_settings& settings = tcp->getCallback()->getSettings();
+		if (0 == settings.tcp_write_high_watermark)
+			return;
+		const size_t queued = tcpQueuedBytes(tcp);
+		if (tcp->isWriteBlocked())
+		{
+			if (queued > settings.tcp_write_low_watermark)
+			{
+				std::lock_guard<std::mutex> guard(m_blockedLock);
+				auto it = m_blockedTcp.find(tcp->getSocketId());
+				if (it != m_blockedTcp.end())
+					it->second = queued;
+				return;
+			}
+			unblockTcp(tcp);
+			tcp->getCallback()->writable(queued);
+		}
+		else if (queued >= settings.tcp_write_high_watermark)
+		{
+			try
+			{
+				std::lock_guard<std::mutex> guard(m_blockedLock);
+				m_blockedTcp[tcp->getSocketId()] = queued;
+				++m_blockedTcpNumber;
+			}
+			catch (...)
+			{
+				NP_FPRINTF((stderr, "Publish blocked tcp error with insufficient memory.\n")); // Still notify.
+			}
+			tcp->setWriteBlocked(true);
+			tcp->getCallback()->writeBlocked(queued);
+		}
+	}
+
+	void CnetworkPool::unblockTcp(Ctcp * const tcp)
+	{
+		tcp->setWriteBlocked(false);
+		std::lock_guard<std::mutex> guard(m_blockedLock);
+		if (m_blockedTcp.erase(tcp->getSocketId()) != 0)
+			--m_blockedTcpNumber;
+	}
+
+	size_t CnetworkPool::blockedQueuedBytes(const socket_id socketId)
+	{
+		if (0 == m_blockedTcpNumber)
+			return 0;
+		std::lock_guard<std::mutex> guard(m_blockedLock);
+		auto it = m_blockedTcp.find(socketId);
+		return it == m_blockedTcp.end() ? 0 : it->second;
+	}
+
+	bool CnetworkPool::flushTcp(Ctcp * const tcp)
+	{
+		if (!tcp->isCorked())
+			return true;
+		tcp->setCorked(false);
+	#ifdef __linux__
+		std::deque<__tcp_file>& files = tcp->getFiles();
+		if (!files.empty())
+		{
+			if (tcp->isSendingFile())
+				return true; // Data after the file waits for it.
+			// Write the data before the first file, then start it.
+			std::vector<uv_buf_t>& cork = tcp->getCork();
+			std::vector<__buffer_release>& corkRelease = tcp->getCorkRelease();
+			const size_t number = files.front().m_corkIndex;
+			if (number != 0)
+			{
+				for (size_t i = 0; i < number; ++i)
+					tcp->corkBytes() -= cork[i].len;
+				const bool bOk = tcpWriteWithTimeout(tcp, cork.data(), corkRelease.data(), number); // Buffers are taken even if fail.
+				cork.erase(cork.begin(), cork.begin() + number);
+				corkRelease.erase(corkRelease.begin(), corkRelease.begin() + number);
+				for (auto& file : files)
+					file.m_corkIndex -= number;
+				if (!bOk)
+					return false;
+			}
+			return startTcpFile(tcp);
+		}
+	#endif
+		std::vector<uv_buf_t>& cork = tcp->getCork();
+		if (cork.empty())
+			return true;
+		std::vector<__buffer_release>& corkRelease = tcp->getCorkRelease();
+		tcp->corkBytes() = 0;
+		const bool bOk = tcpWriteWithTimeout(tcp, cork.data(), corkRelease.data(), cork.size()); // Buffers are taken even if fail.
+		cork.clear();
+		corkRelease.clear();
+		return bOk;
+	}
+
+	void CnetworkPool::flushCorkedTcp()
+	{
+		// Callback may send and append, so use index.
+		for (size_t i = 0; i < m_corkedTcp.size(); ++i)
+		{
+			auto it = m_socketId2stream.find(m_corkedTcp[i]);
+			if (it == m_socketId2stream.end())
+				continue; // Closed and dropped.
+			Ctcp *tcp = it->second.get();
+			if (!flushTcp(tcp))
+				shutdownTcpConnection(tcp);
+			else if (tcp->isWriteBlocked())
+				checkTcpWatermark(tcp); // Try write may take some.
+		}
+		m_corkedTcp.clear();
+		uv_idle_stop(&m_flushIdle);
+	}
+
+#ifdef __linux__
+	bool CnetworkPool::tcpSendFile(Ctcp * const tcp, const int fd, const int64_t offset, const size_t length)
+	{
+		try
+		{
+			if (!tcp->isCorked())
+				m_corkedTcp.push_back(tcp->getSocketId());
+			tcp->getFiles().push_back(__tcp_file{ fd, offset, length, tcp->getCork().size() });
+		}
+		catch (...)
+		{
+			NP_FPRINTF((stderr, "Send file error with insufficient memory.\n"));
+			::close(fd);
+			return false;
+		}
+		if (!tcp->isCorked())
+		{
+			tcp->setCorked(true);
+			if (1 == m_corkedTcp.size())
+				uv_idle_start(&m_flushIdle, [](uv_idle_t *idle) {}); // Never fail.
+		}
+		return true;
+	}
+
+	bool CnetworkPool::startTcpFile(Ctcp * const tcp)
+	{
+		if (!setTcpTimeout(tcp, tcp->getCallback()->getTimeoutSettings().tcp_send_timeout_in_seconds))
+			goto_label((stderr, "Send file error with set timer error.\n"), _ec);
+		tcp->setSendingFile(true);
+		// Or polled by write callback when the data before it drains.
+		if (0 == uv_stream_get_write_queue_size(tcp->getStream()))
+			return pollTcpFile(tcp);
+		return true;
+	_ec:
+		return false;
+	}
+
+	bool CnetworkPool::pollTcpFile(Ctcp * const tcp)
+	{
+		// Wait for writable even if it's ready now, so files never recurse.
+		uv_poll_t *poll = tcp->getFilePoll();
+		if (nullptr == poll)
+			goto_label((stderr, "Send file error with poll error.\n"), _ec);
+		on_uv_error_goto_label(
+			uv_poll_start(poll, UV_WRITABLE,
+				[](uv_poll_t *poll, int status, int events)
+			{
+				Ctcp *tcp = (Ctcp *)poll->data;
+				CnetworkPool *pool = tcp->getPool();
+				if (status < 0 || !pool->continueTcpFile(tcp))
+					pool->shutdownTcpConnection(tcp);
+			}),
+			(stderr, "Send file error with poll error.\n"), _ec);
+		return true;
+	_ec:
+		return false;
+	}
+
+	bool CnetworkPool::continueTcpFile(Ctcp * const tcp)
+	{
+		// Data queued before the file goes first, stop polling(Level triggered) until write callback drains it.
+		if (uv_stream_get_write_queue_size(tcp->getStream()) != 0)
+		{
+			uv_poll_stop(tcp->getFilePoll());
+			return true;
+		}
+		static const size_t s_fileQuantum = 1024 * 1024; // Let other connections go.
+		std::deque<__tcp_file>& files = tcp->getFiles();
+		__tcp_file& file = files.front();
+		size_t sent = 0;
+		while (file.m_length > 0 && sent < s_fileQuantum)
+		{
+			off_t offset = (off_t)file.m_offset;
+			const ssize_t n = sendfile(tcp->getFilePollFd(), file.m_fd, &offset, std::min(file.m_length, s_fileQuantum - sent));
+			if (n < 0)
+			{
+				if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)
+					break; // Wait for writable.
+				NP_FPRINTF((stderr, "Send file error %s.\n", strerror(errno)));
+				return false;
+			}
+			if (0 == n)
+			{
+				NP_FPRINTF((stderr, "Send file error with file shorter than length.\n"));
+				return false;
+			}
+			file.m_offset += n;
+			file.m_length -= (size_t)n;
+			sent += (size_t)n;
+		}
+		if (file.m_length > 0)
+		{
+			// Progress restarts send timeout, so only a stalled file times out.
+			if (sent > 0)
+				return setTcpTimeout(tcp, tcp->getCallback()->getTimeoutSettings().tcp_send_timeout_in_seconds);
+			return true; // Rest when writable again.
+		}
+		// Done, then the data and files after it.
+		::close(file.m_fd);
+		files.pop_front();
+		tcp->setSendingFile(false);
+		uv_poll_stop(tcp->getFilePoll());
+		tcp->setCorked(true);
+		if (!flushTcp(tcp))
+			return false;
+		if (files.empty())
+		{
+			if (!m_closingTcp.empty())
+			{
+				auto it = m_closingTcp.find(tcp->getSocketId());
+				if (it != m_closingTcp.end())
+				{
+					Ctcp::ptr closing(std::move(it->second));
+					m_closingTcp.erase(it);
+					Ctcp::shutdown_and_close(std::move(closing));
+					return true;
+				}
+			}
+			if (0 == uv_stream_get_write_queue_size(tcp->getStream()))
+				return setTcpTimeout(tcp, tcp->getCallback()->getTimeoutSettings().tcp_idle_timeout_in_seconds);
+		}
+		return true;
+	}
+#endif
+
+	CtcpServer::ptr CnetworkPool::bindAndListenTcp(const Csockaddr& local, CtcpServerCallback::ptr&& callback, const socket_id socketId)
+	{
+		const bool bReusePort = socketId != SOCKET_ID_UNSPEC;
+		CtcpServer::ptr tcpServer = CtcpServer::alloc(this, &m_loop, std::forward<CtcpServerCallback::ptr>(callback),
+			bReusePort ? socketId : nextSocketId(), bReusePort ? local.getSockaddr()->sa_family : AF_UNSPEC);
+		if (!tcpServer || SOCKET_ID_UNSPEC == tcpServer->getSocketId())
+			goto_label((stderr, "Bind and listen tcp error with insufficient memory or socket id.\n"), _ec);
+		if (bReusePort && !tcpServer->reusePort())
+			goto_label((stderr, "Bind and listen tcp reuse port error.\n"), _ec);
 		on_uv_error_goto_label(
 			uv_tcp_bind(tcpServer->getTcp(), local.getSockaddr(), 0),
 			(stderr, "Bind and listen tcp bind error.\n"), _ec);
@@ -186,17 +924,38 @@ namespace NETWORK_POOL
 				tcpServer->getCallback()->listenError(status);
 				return;
 			}
+			if (pool->overBudget())
+			{
+				pool->refuseTcp(server);
+				return;
+			}
 			// Prepare for the new connection.
 			CtcpCallback::ptr clientCallback = tcpServer->getCallback()->newTcpCallback();
 			if (!clientCallback)
 			{
 				NP_FPRINTF((stderr, "New incoming connection tcp callback allocation error.\n"));
+				pool->refuseTcp(server);
+				return;
+			}
+		#ifndef _WIN32
+			CnetworkPool *loop = pool->balanceLoop();
+			if (loop != nullptr && loop != pool)
+			{
+				pool->acceptToLoop(server, loop, std::move(clientCallback));
+				return;
+			}
+		#endif
+			Ctcp::ptr clientTcp = Ctcp::alloc(pool, &pool->m_loop, std::move(clientCallback), pool->nextSocketId());
+			if (clientTcp && SOCKET_ID_UNSPEC == clientTcp->getSocketId())
+			{
+				NP_FPRINTF((stderr, "New incoming connection refused with socket id used up.\n"));
+				uv_accept(server, clientTcp->getStream()); // Auto close.
 				return;
 			}
-			Ctcp::ptr clientTcp = Ctcp::alloc(pool, &pool->m_loop, std::move(clientCallback), ++pool->m_socketIdCounter);
 			if (!clientTcp)
 			{
 				NP_FPRINTF((stderr, "New incoming connection tcp allocation error.\n"));
+				pool->refuseTcp(server);
 				// Auto free cb if not moved.
 				return;
 			}
@@ -229,6 +988,110 @@ namespace NETWORK_POOL
 		return std::move(CtcpServer::ptr());
 	}
 
+	void CnetworkPool::bindAndListenTcpGroup(const Csockaddr& local, CtcpServerCallback::ptr&& callback)
+	{
+		std::shared_ptr<CtcpServerCallback> shared;
+		try
+		{
+			shared.reset(callback.release());
+		}
+		catch (...)
+		{
+			NP_FPRINTF((stderr, "Bind and listen tcp group error with insufficient memory.\n"));
+			return;
+		}
+		// Main listener picks the port(Maybe 0 in local), the others join with the same socket id and real local.
+		CtcpServerCallback::ptr mainCallback(new (std::nothrow) CsharedTcpServerCallback(shared, true));
+		if (!mainCallback)
+		{
+			NP_FPRINTF((stderr, "Bind and listen tcp group error with insufficient memory.\n"));
+			return;
+		}
+		CtcpServer::ptr tcpServer = bindAndListenTcp(local, std::move(mainCallback), nextSocketId());
+		if (!tcpServer)
+			return;
+		const socket_id socketId = tcpServer->getSocketId();
+		sockaddr_storage realLocal;
+		int len = sizeof(realLocal);
+		if (uv_tcp_getsockname(tcpServer->getTcp(), (sockaddr *)&realLocal, &len) != 0)
+			len = 0;
+		m_tcpServers.insert(std::make_pair(socketId, std::move(tcpServer)));
+		for (size_t i = 1; i < m_loops.size() && len > 0; ++i)
+		{
+			CtcpServerCallback::ptr shardCallback(new (std::nothrow) CsharedTcpServerCallback(shared, false));
+			if (!shardCallback)
+			{
+				NP_FPRINTF((stderr, "Bind and listen tcp group error with insufficient memory.\n"));
+				break;
+			}
+			m_loops[i]->bind(std::move(__pending_bind(Csockaddr((const sockaddr *)&realLocal, len), std::move(shardCallback), socketId)));
+		}
+	}
+
+#ifndef _WIN32
+	void CnetworkPool::acceptToLoop(uv_stream_t * const server, CnetworkPool * const loop, CtcpCallback::ptr&& callback)
+	{
+		// Accept with a temporary handle and duplicate the socket, the handle closes its own one.
+		Ctcp::ptr tcp = Ctcp::alloc(this, &m_loop, CtcpCallback::ptr(), SOCKET_ID_UNSPEC);
+		if (!tcp)
+		{
+			NP_FPRINTF((stderr, "Accept to loop tcp allocation error.\n"));
+			return;
+		}
+		uv_os_fd_t fd;
+		uv_os_sock_t socket;
+		on_uv_error_goto_label(
+			uv_accept(server, tcp->getStream()),
+			(stderr, "Accept to loop tcp accept error.\n"), _ec);
+		on_uv_error_goto_label(
+			uv_fileno((const uv_handle_t *)tcp->getTcp(), &fd),
+			(stderr, "Accept to loop tcp fileno error.\n"), _ec);
+		socket = dup(fd);
+		if (socket < 0)
+			goto_label((stderr, "Accept to loop tcp dup error.\n"), _ec);
+		{
+			// Count it at once, so a burst of accepts is spread.
+			++loop->m_connectionNumber;
+			loop->command(command_accept, __pending_accept(socket, std::forward<CtcpCallback::ptr>(callback)));
+		}
+	_ec:; // Auto free tcp.
+	}
+
+	void CnetworkPool::openTcpConnection(const uv_os_sock_t socket, CtcpCallback::ptr&& callback)
+	{
+		--m_connectionNumber; // Counted by acceptor, count again when startup.
+		Ctcp::ptr tcp = Ctcp::alloc(this, &m_loop, std::forward<CtcpCallback::ptr>(callback), nextSocketId());
+		if (!tcp || SOCKET_ID_UNSPEC == tcp->getSocketId())
+		{
+			NP_FPRINTF((stderr, "Open tcp connection allocation error.\n"));
+			::close(socket);
+			return;
+		}
+		if (uv_tcp_open(tcp->getTcp(), socket) != 0)
+		{
+			NP_FPRINTF((stderr, "Open tcp connection open error.\n"));
+			::close(socket);
+			return; // Auto free tcp.
+		}
+		// Customize.
+		if (!tcp->customize())
+			goto_label((stderr, "Open tcp connection customize error.\n"), _ec);
+		// Get peer.
+		sockaddr_storage peer;
+		int len;
+		len = sizeof(peer);
+		on_uv_error_goto_label(
+			uv_tcp_getpeername(tcp->getTcp(), (sockaddr *)&peer, &len),
+			(stderr, "Open tcp connection getpeername error.\n"), _ec);
+		// Start read with timeout.
+		if (!tcpReadWithTimeout(tcp.get()))
+			goto_label((stderr, "Open tcp connection read start error.\n"), _ec);
+		// Startup connection.
+		startupTcpConnection(std::move(tcp), Csockaddr((const sockaddr *)&peer, len));
+	_ec:; // Auto free tcp if not moved.
+	}
+#endif
+
 	Ctcp::ptr CnetworkPool::connectTcp(const Csockaddr& remote, CtcpCallback::ptr&& callback)
 	{
 		uv_connect_t *connect = (uv_connect_t *)__alloc(sizeof(uv_connect_t));
@@ -237,9 +1100,9 @@ namespace NETWORK_POOL
 			NP_FPRINTF((stderr, "Connect tcp error with insufficient memory.\n"));
 			return std::move(Ctcp::ptr());
 		}
-		Ctcp::ptr tcp = Ctcp::alloc(this, &m_loop, std::forward<CtcpCallback::ptr>(callback), ++m_socketIdCounter);
-		if (!tcp)
-			goto_label((stderr, "Connect tcp error with insufficient memory.\n"), _ec);
+		Ctcp::ptr tcp = Ctcp::alloc(this, &m_loop, std::forward<CtcpCallback::ptr>(callback), nextSocketId());
+		if (!tcp || SOCKET_ID_UNSPEC == tcp->getSocketId())
+			goto_label((stderr, "Connect tcp error with insufficient memory or socket id.\n"), _ec);
 		if (!setTcpTimeout(tcp.get(), tcp->getCallback()->getTimeoutSettings().tcp_connect_timeout_in_seconds))
 			goto_label((stderr, "Connect tcp error with set timeout error.\n"), _ec);
 		on_uv_error_goto_label(
@@ -287,7 +1150,12 @@ namespace NETWORK_POOL
 
 	bool CnetworkPool::udpSend(Cudp * const udp, const Csockaddr& remote, Cbuffer * const data, const size_t number)
 	{
-		__udp_send_with_info *udpSendInfo = (__udp_send_with_info *)__alloc(sizeof(__udp_send_with_info) + sizeof(uv_buf_t) * (number - 1));
+		if (overBudget())
+		{
+			udp->getCallback()->sendError(ENOBUFS);
+			return false;
+		}
+		__udp_send_with_info *udpSendInfo = (__udp_send_with_info *)__alloc(sizeof(__udp_send_with_info) + sizeof(uv_buf_t) * (number - 1) + sizeof(__buffer_release) * number);
 		if (nullptr == udpSendInfo)
 		{
 			NP_FPRINTF((stderr, "Send udp error with insufficient memory.\n"));
@@ -296,7 +1164,7 @@ namespace NETWORK_POOL
 		}
 		udpSendInfo->num = number;
 		for (size_t i = 0; i < number; ++i)
-			data[i].transfer(udpSendInfo->buf[i]);
+			data[i].transfer(udpSendInfo->buf[i], udpSendRelease(udpSendInfo)[i]);
 		int iRet = uv_udp_send(&udpSendInfo->udpSend, udp->getUdp(), udpSendInfo->buf, (unsigned int)udpSendInfo->num, remote.getSockaddr(),
 			[](uv_udp_send_t *req, int status)
 		{
@@ -308,7 +1176,7 @@ namespace NETWORK_POOL
 			// Free udp send buffer.
 			__udp_send_with_info *udpSendInfo = container_of(req, __udp_send_with_info, udpSend);
 			for (size_t i = 0; i < udpSendInfo->num; ++i)
-				__free(udpSendInfo->buf[i].base);
+				__release_buffer(udpSendInfo->buf[i], udpSendRelease(udpSendInfo)[i]);
 			__free(udpSendInfo);
 		});
 		if (iRet != 0)
@@ -317,7 +1185,7 @@ namespace NETWORK_POOL
 			udp->getCallback()->sendError(iRet);
 			// Free udp send buffer.
 			for (size_t i = 0; i < udpSendInfo->num; ++i)
-				__free(udpSendInfo->buf[i].base);
+				__release_buffer(udpSendInfo->buf[i], udpSendRelease(udpSendInfo)[i]);
 			__free(udpSendInfo);
 			return false;
 		}
@@ -326,9 +1194,9 @@ namespace NETWORK_POOL
 
 	Cudp::ptr CnetworkPool::bindAndListenUdp(const Csockaddr& local, CudpCallback::ptr&& callback)
 	{
-		Cudp::ptr udp = Cudp::alloc(this, &m_loop, std::forward<CudpCallback::ptr>(callback), ++m_socketIdCounter);
-		if (!udp)
-			goto_label((stderr, "Bind and listen udp error with insufficient memory.\n"), _ec);
+		Cudp::ptr udp = Cudp::alloc(this, &m_loop, std::forward<CudpCallback::ptr>(callback), nextSocketId());
+		if (!udp || SOCKET_ID_UNSPEC == udp->getSocketId())
+			goto_label((stderr, "Bind and listen udp error with insufficient memory or socket id.\n"), _ec);
 		on_uv_error_goto_label(
 			uv_udp_bind(udp->getUdp(), local.getSockaddr(), 0),
 			(stderr, "Bind and listen udp bind error.\n"), _ec);
@@ -381,6 +1249,441 @@ namespace NETWORK_POOL
 		return std::move(Cudp::ptr());
 	}
 
+	void CnetworkPool::freeCommand(__command * const command)
+	{
+		switch (command->m_type)
+		{
+		case command_bind:
+			delete static_cast<__command_node<__pending_bind> *>(command);
+			break;
+
+		case command_send_tcp:
+			delete static_cast<__command_node<__pending_send_tcp> *>(command);
+			break;
+
+		case command_send_tcp_fragments:
+			delete static_cast<__command_node<__pending_send_tcp_fragments> *>(command);
+			break;
+
+		case command_send_udp:
+			delete static_cast<__command_node<__pending_send_udp> *>(command);
+			break;
+
+		case command_connect:
+			delete static_cast<__command_node<__pending_connect> *>(command);
+			break;
+
+		case command_close:
+			delete static_cast<__command_node<__pending_close> *>(command);
+			break;
+
+	#ifndef _WIN32
+		case command_accept:
+			delete static_cast<__command_node<__pending_accept> *>(command); // Socket is closed if not taken.
+			break;
+	#endif
+
+	#ifdef __linux__
+		case command_send_file:
+			delete static_cast<__command_node<__pending_send_file> *>(command); // File is closed if not taken.
+			break;
+	#endif
+
+		case command_schedule:
+		case command_cancel:
+		case command_post:
+			delete static_cast<__command_node<__pending_task> *>(command); // Task is freed without run if not taken.
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	void CnetworkPool::executeCommand(__command * const command)
+	{
+		switch (command->m_type)
+		{
+		case command_bind:
+		{
+			__pending_bind& req = static_cast<__command_node<__pending_bind> *>(command)->m_data;
+			if (req.m_bBind)
+			{
+				const Csockaddr& local = req.m_local;
+				if (req.m_tcpServerCallback)
+				{
+				#ifdef SO_REUSEPORT
+					if (SOCKET_ID_UNSPEC == req.m_socketId && m_loops.size() > 1 && balance_reuse_port == m_balance)
+					{
+						bindAndListenTcpGroup(local, std::move(req.m_tcpServerCallback));
+						break;
+					}
+				#endif
+					CtcpServer::ptr tcpServer = bindAndListenTcp(local, std::move(req.m_tcpServerCallback), req.m_socketId);
+					if (tcpServer)
+						m_tcpServers.insert(std::make_pair(tcpServer->getSocketId(), std::move(tcpServer)));
+				}
+				else if (req.m_udpCallback)
+				{
+					Cudp::ptr udp = bindAndListenUdp(local, std::move(req.m_udpCallback));
+					if (udp)
+						m_udpServers.insert(std::make_pair(udp->getSocketId(), std::move(udp)));
+				}
+			}
+			else
+			{
+				const socket_id& socketId = req.m_socketId;
+				switch (req.m_protocol)
+				{
+				case CnetworkNode::protocol_tcp:
+				{
+					auto it = m_tcpServers.find(socketId);
+					if (it != m_tcpServers.end())
+					{
+						CtcpServer::ptr tcpServers(std::move(it->second));
+						m_tcpServers.erase(it);
+						tcpServers->getCallback()->shutdown();
+						// Auto free.
+					}
+					// Listener group lives on every loop.
+					for (size_t i = 1; i < m_loops.size(); ++i)
+						m_loops[i]->bind(std::move(__pending_bind(CnetworkNode::protocol_tcp, socketId)));
+				}
+					break;
+
+				case CnetworkNode::protocol_udp:
+				{
+					auto it = m_udpServers.find(socketId);
+					if (it != m_udpServers.end())
+					{
+						Cudp::ptr udp(std::move(it->second));
+						m_udpServers.erase(it);
+						uv_udp_recv_stop(udp->getUdp()); // Ignore the result.
+						udp->getCallback()->shutdown();
+						// Auto free.
+					}
+				}
+					break;
+
+				default:
+					break;
+				}
+			}
+		}
+			break;
+
+		case command_send_tcp:
+		{
+			__pending_send_tcp& req = static_cast<__command_node<__pending_send_tcp> *>(command)->m_data;
+			auto it = m_socketId2stream.find(req.m_socketId);
+			if (it == m_socketId2stream.end())
+				break;
+			Ctcp *tcp = it->second.get();
+			if (!tcpCork(tcp, &req.m_data, 1))
+				shutdownTcpConnection(tcp);
+		}
+			break;
+
+		case command_send_tcp_fragments:
+		{
+			__pending_send_tcp_fragments& req = static_cast<__command_node<__pending_send_tcp_fragments> *>(command)->m_data;
+			auto it = m_socketId2stream.find(req.m_socketId);
+			if (it == m_socketId2stream.end())
+				break;
+			Ctcp *tcp = it->second.get();
+			if (!tcpCork(tcp, req.m_fragments.data(), req.m_fragments.size()))
+				shutdownTcpConnection(tcp);
+		}
+			break;
+
+		case command_send_udp:
+		{
+			__pending_send_udp& req = static_cast<__command_node<__pending_send_udp> *>(command)->m_data;
+			auto it = m_udpServers.find(req.m_socketId);
+			if (it == m_udpServers.end())
+				break;
+			udpSend(it->second.get(), req.m_remote, &req.m_data, 1);
+		}
+			break;
+
+		case command_connect:
+		{
+			__pending_connect& req = static_cast<__command_node<__pending_connect> *>(command)->m_data;
+			Ctcp::ptr tcp = connectTcp(req.m_remote, std::move(req.m_callback));
+			if (tcp)
+				m_connecting.insert(std::make_pair(tcp->getSocketId(), std::move(tcp)));
+		}
+			break;
+
+		case command_close:
+		{
+			__pending_close& req = static_cast<__command_node<__pending_close> *>(command)->m_data;
+			auto it = m_socketId2stream.find(req.m_socketId);
+			if (it == m_socketId2stream.end())
+				break;
+			Ctcp *tcp = it->second.get();
+			// No force close means shutdown, and it's a type of send.
+			if (!req.m_bForce && setTcpTimeout(tcp, tcp->getCallback()->getTimeoutSettings().tcp_send_timeout_in_seconds))
+				shutdownTcpConnection(tcp, true); // Timer still working until close, so timeout when shutdown will force close the connection.
+			else
+				shutdownTcpConnection(tcp); // Force close.
+		}
+			break;
+
+	#ifdef __linux__
+		case command_send_file:
+		{
+			__pending_send_file& req = static_cast<__command_node<__pending_send_file> *>(command)->m_data;
+			auto it = m_socketId2stream.find(req.m_socketId);
+			if (it == m_socketId2stream.end())
+				break;
+			Ctcp *tcp = it->second.get();
+			const int fd = req.m_fd;
+			req.m_fd = -1; // Taken.
+			if (!tcpSendFile(tcp, fd, req.m_offset, req.m_length))
+				shutdownTcpConnection(tcp);
+		}
+			break;
+	#endif
+
+	#ifndef _WIN32
+		case command_accept:
+		{
+			// Accepted by other loop.
+			__pending_accept& req = static_cast<__command_node<__pending_accept> *>(command)->m_data;
+			const uv_os_sock_t socket = req.m_socket;
+			req.m_socket = -1; // Taken.
+			openTcpConnection(socket, std::move(req.m_callback));
+		}
+			break;
+	#endif
+
+		case command_schedule:
+		{
+			__pending_task& req = static_cast<__command_node<__pending_task> *>(command)->m_data;
+			addTimer(req.m_timerId, req.m_delayInMs, std::move(req.m_task));
+		}
+			break;
+
+		case command_cancel:
+			cancelTimer(static_cast<__command_node<__pending_task> *>(command)->m_data.m_timerId);
+			break;
+
+		case command_post:
+			static_cast<__command_node<__pending_task> *>(command)->m_data.m_task->run();
+			break;
+
+		default:
+			break;
+		}
+		freeCommand(command);
+	}
+
+	bool CnetworkPool::lanesEmpty() const
+	{
+		for (const auto& lane : m_lanes)
+		{
+			if (!lane.empty())
+				return false;
+		}
+		return true;
+	}
+
+	void CnetworkPool::drainCommands()
+	{
+		static const size_t s_laneQuantum = 32; // Commands of one lane in a turn.
+
+		m_draining = true;
+		// Sort into lanes.
+		__mpsc_node *node;
+		while ((node = m_commands.pop()) != nullptr)
+		{
+			__command *command = static_cast<__command *>(node);
+			switch (command->m_type)
+			{
+			case command_send_tcp:
+			case command_send_tcp_fragments:
+			case command_send_file:
+			case command_close:
+				m_lanes[lane_tcp].push(command);
+				break;
+
+			case command_send_udp:
+				m_lanes[lane_udp].push(command);
+				break;
+
+			case command_schedule:
+			case command_cancel:
+			case command_post:
+				m_lanes[lane_task].push(command);
+				break;
+
+			default:
+				m_lanes[lane_control].push(command);
+				break;
+			}
+		}
+		// Execute round-robin within budget.
+		const size_t budgetOperations = m_main->m_budgetOperations;
+		const size_t budgetBytes = m_main->m_budgetBytes;
+		size_t operations = 0;
+		size_t bytes = 0;
+		bool bExhausted = false;
+		while (!bExhausted && !lanesEmpty())
+		{
+			__command_lane& lane = m_lanes[m_nextLane];
+			m_nextLane = (m_nextLane + 1) % lane_number;
+			for (size_t i = 0; i < s_laneQuantum; ++i)
+			{
+				__command *command = lane.pop();
+				if (nullptr == command)
+					break;
+				if (command_send_tcp == command->m_type)
+					bytes += static_cast<__command_node<__pending_send_tcp> *>(command)->m_data.m_data.getLength();
+				else if (command_send_tcp_fragments == command->m_type)
+				{
+					for (const auto& fragment : static_cast<__command_node<__pending_send_tcp_fragments> *>(command)->m_data.m_fragments)
+						bytes += fragment.getLength();
+				}
+				else if (command_send_udp == command->m_type)
+					bytes += static_cast<__command_node<__pending_send_udp> *>(command)->m_data.m_data.getLength();
+				executeCommand(command);
+				++operations;
+				if ((budgetOperations != 0 && operations >= budgetOperations) || (budgetBytes != 0 && bytes >= budgetBytes))
+				{
+					bExhausted = true;
+					break;
+				}
+			}
+		}
+		m_draining = false;
+		// Resume in next iteration, or a producer which saw draining may have pushed after the last pop.
+		if (!lanesEmpty() || !m_commands.empty())
+			uv_async_send(m_wakeup->getAsync());
+	}
+
+	void CnetworkPool::checkMemoryBudget()
+	{
+		static const uint64_t s_sampleInterval = 10; // In milliseconds.
+		CnetworkPool * const main = m_main;
+		const size_t budget = main->m_memoryBudget;
+		if (0 == budget)
+		{
+			if (main->m_overBudget)
+				main->m_overBudget = false;
+		}
+		else
+		{
+			// Sample by the loop which claims the time.
+			const uint64_t now = uv_now(&m_loop);
+			uint64_t last = main->m_budgetSampleTime;
+			if (now >= last + s_sampleInterval && main->m_budgetSampleTime.compare_exchange_strong(last, now))
+			{
+				size_t count;
+				size_t usage;
+				__get_usage_data(count, usage);
+				if (usage > budget)
+				{
+					main->m_overBudget = true;
+					++main->m_budgetEpoch;
+				}
+				else if (usage <= budget - budget / 8)
+					main->m_overBudget = false;
+			}
+		}
+		if (main->m_overBudget)
+		{
+			const size_t epoch = main->m_budgetEpoch;
+			if (epoch != m_pauseEpoch)
+			{
+				m_pauseEpoch = epoch;
+				pauseLargestTcp();
+			}
+			if (!uv_is_active((const uv_handle_t *)&m_budgetTimer))
+			{
+				uv_timer_start(&m_budgetTimer,
+					[](uv_timer_t *timer)
+				{
+					((CnetworkPool *)timer->data)->checkMemoryBudget();
+				}, s_sampleInterval, s_sampleInterval); // Never fail.
+			}
+		}
+		else
+		{
+			if (!m_pausedTcp.empty())
+				resumePausedTcp();
+			if (uv_is_active((const uv_handle_t *)&m_budgetTimer))
+				uv_timer_stop(&m_budgetTimer);
+		}
+	}
+
+	void CnetworkPool::refuseTcp(uv_stream_t * const server)
+	{
+		// Refuse by closing at once, or listen stops until accepted.
+		Ctcp::ptr refused(std::move(m_refusal));
+		if (!refused)
+			refused = Ctcp::alloc(this, &m_loop, CtcpCallback::ptr(), SOCKET_ID_UNSPEC);
+		if (refused)
+			uv_accept(server, refused->getStream()); // Auto close.
+		// Refill the spare for next time.
+		m_refusal = Ctcp::alloc(this, &m_loop, CtcpCallback::ptr(), SOCKET_ID_UNSPEC);
+	}
+
+	void CnetworkPool::pauseLargestTcp()
+	{
+		// Pause reading of the eighth(At least one) of connections which queue most, so they request less.
+		std::vector<std::pair<size_t, Ctcp *>> queued;
+		size_t number;
+		try
+		{
+			for (const auto& pair : m_socketId2stream)
+			{
+				Ctcp *tcp = pair.second.get();
+				if (tcp->isReadPaused())
+					continue;
+				const size_t bytes = tcpQueuedBytes(tcp);
+				if (bytes != 0)
+					queued.push_back(std::make_pair(bytes, tcp));
+			}
+			if (queued.empty())
+				return;
+			number = std::max<size_t>(1, queued.size() / 8);
+			std::partial_sort(queued.begin(), queued.begin() + number, queued.end(),
+				[](const std::pair<size_t, Ctcp *>& a, const std::pair<size_t, Ctcp *>& b)
+			{
+				return a.first > b.first;
+			});
+			m_pausedTcp.reserve(m_pausedTcp.size() + number);
+		}
+		catch (...)
+		{
+			return; // Try again in next epoch.
+		}
+		for (size_t i = 0; i < number; ++i)
+		{
+			Ctcp *tcp = queued[i].second;
+			uv_read_stop(tcp->getStream()); // Never fail.
+			tcp->setReadPaused(true);
+			m_pausedTcp.push_back(tcp->getSocketId());
+		}
+	}
+
+	void CnetworkPool::resumePausedTcp()
+	{
+		std::vector<socket_id> paused(std::move(m_pausedTcp));
+		m_pausedTcp.clear();
+		for (const auto socketId : paused)
+		{
+			auto it = m_socketId2stream.find(socketId);
+			if (it == m_socketId2stream.end())
+				continue; // Closed.
+			Ctcp *tcp = it->second.get();
+			tcp->setReadPaused(false);
+			if (!tcpReadStart(tcp))
+				shutdownTcpConnection(tcp);
+		}
+	}
+
 	void CnetworkPool::internalThread()
 	{
 		// Init loop.
@@ -393,34 +1696,32 @@ namespace NETWORK_POOL
 			[](uv_async_t *async)
 		{
 			CnetworkPool *pool = Casync::obtain(async)->getPool();
-			// Copy pending to local first.
-			if (!pool->m_lock.try_lock())
-			{
-				uv_async_send(async); // Deal when next loop.
-				return;
-			}
-			// Just use lock and unlock, because we never get exception here(fatal error).
-			std::deque<__pending_bind> bindCopy(std::move(pool->m_pendingBind));
-			std::deque<__pending_send_tcp> sendTcpCopy(std::move(pool->m_pendingSendTcp));
-			std::deque<__pending_send_udp> sendUdpCopy(std::move(pool->m_pendingSendUdp));
-			std::deque<__pending_connect> connectCopy(std::move(pool->m_pendingConnect));
-			std::deque<__pending_close> closeCopy(std::move(pool->m_pendingClose));
-			pool->m_pendingBind.clear();
-			pool->m_pendingSendTcp.clear();
-			pool->m_pendingSendUdp.clear();
-			pool->m_pendingConnect.clear();
-			pool->m_pendingClose.clear();
-			pool->m_lock.unlock();
 			// Deal with request(s).
 			if (pool->m_bWantExit)
 			{
 				//
 				// Stop and free all resources.
 				//
-				// Async.(Free in lock for safety.)
+				// Async.(Free in lock for safety, after producers which saw no exit.)
+				while (pool->m_waking != 0)
+					std::this_thread::yield();
 				pool->m_lock.lock();
 				pool->m_wakeup.reset();
 				pool->m_lock.unlock();
+				// Flush.
+				uv_close((uv_handle_t *)&pool->m_flushCheck, nullptr);
+				uv_close((uv_handle_t *)&pool->m_flushIdle, nullptr);
+				pool->m_corkedTcp.clear();
+				// Commands.
+				__mpsc_node *node;
+				while ((node = pool->m_commands.pop()) != nullptr)
+					freeCommand(static_cast<__command *>(node));
+				for (auto& lane : pool->m_lanes)
+				{
+					__command *command;
+					while ((command = lane.pop()) != nullptr)
+						freeCommand(command);
+				}
 				// TCP servers.
 				std::unordered_map<socket_id, CtcpServer::ptr> tmpTcpServers(std::move(pool->m_tcpServers));
 				pool->m_tcpServers.clear();
@@ -428,7 +1729,7 @@ namespace NETWORK_POOL
 					pair.second->getCallback()->shutdown();
 				tmpTcpServers.clear();
 				// UDP servers.
-				std::unordered_map<socket_id, Cudp::ptr> tmpUdpServers(std::move(pool->m_udpServers));
+				CslotMap<Cudp::ptr> tmpUdpServers(std::move(pool->m_udpServers));
 				pool->m_udpServers.clear();
 				for (const auto& pair : tmpUdpServers)
 				{
@@ -437,114 +1738,36 @@ namespace NETWORK_POOL
 				}
 				tmpUdpServers.clear();
 				// TCP connections.
-				std::unordered_map<socket_id, Ctcp::ptr> tmpSocketId2stream(std::move(pool->m_socketId2stream));
+				CslotMap<Ctcp::ptr> tmpSocketId2stream(std::move(pool->m_socketId2stream));
 				pool->m_socketId2stream.clear();
 				for (const auto& pair : tmpSocketId2stream)
 					pair.second->getCallback()->shutdown();
 				tmpSocketId2stream.clear();
 				// TCP connecting will free by smart pointer.
 				pool->m_connecting.clear(); // No startup so no need to call shutdown.
-				// All callback in copy will free by smart pointer.
+				pool->m_pausedTcp.clear();
+				pool->m_timers.clear(); // Tasks not run are freed.
+				uv_close((uv_handle_t *)&pool->m_budgetTimer, nullptr);
+				pool->m_refusal.reset();
+				// Tcp still shutting down keeps its send timeout, the timer closes when the wheel is empty.
+				if (pool->m_wheel.empty())
+					uv_close((uv_handle_t *)&pool->m_wheelTimer, nullptr);
+			#ifdef __linux__
+				pool->m_closingTcp.clear(); // Closed by user, the files left are dropped.
+			#endif
+				pool->m_connectionNumber = 0;
+				pool->m_blockedLock.lock();
+				pool->m_blockedTcp.clear();
+				pool->m_blockedTcpNumber = 0;
+				pool->m_blockedLock.unlock();
+			#ifdef NP_ZEROCOPY
+				// Zerocopy.
+				pool->drainZerocopy(true);
+				uv_close((uv_handle_t *)&pool->m_zerocopyTimer, nullptr);
+			#endif
 			}
 			else
-			{
-				//
-				// Bind, send, connect & close.
-				//
-				// Bind.
-				for (auto& req : bindCopy)
-				{
-					if (req.m_bBind)
-					{
-						const Csockaddr& local = req.m_local;
-						if (req.m_tcpServerCallback)
-						{
-							CtcpServer::ptr tcpServer = pool->bindAndListenTcp(local, std::move(req.m_tcpServerCallback));
-							if (tcpServer)
-								pool->m_tcpServers.insert(std::make_pair(tcpServer->getSocketId(), std::move(tcpServer)));
-						}
-						else if (req.m_udpCallback)
-						{
-							Cudp::ptr udp = pool->bindAndListenUdp(local, std::move(req.m_udpCallback));
-							if (udp)
-								pool->m_udpServers.insert(std::make_pair(udp->getSocketId(), std::move(udp)));
-						}
-					}
-					else
-					{
-						const socket_id& socketId = req.m_socketId;
-						switch (req.m_protocol)
-						{
-						case CnetworkNode::protocol_tcp:
-						{
-							auto it = pool->m_tcpServers.find(socketId);
-							if (it != pool->m_tcpServers.end())
-							{
-								CtcpServer::ptr tcpServers(std::move(it->second));
-								pool->m_tcpServers.erase(it);
-								tcpServers->getCallback()->shutdown();
-								// Auto free.
-							}
-						}
-							break;
-
-						case CnetworkNode::protocol_udp:
-						{
-							auto it = pool->m_udpServers.find(socketId);
-							if (it != pool->m_udpServers.end())
-							{
-								Cudp::ptr udp(std::move(it->second));
-								pool->m_udpServers.erase(it);
-								uv_udp_recv_stop(udp->getUdp()); // Ignore the result.
-								udp->getCallback()->shutdown();
-								// Auto free.
-							}
-						}
-							break;
-
-						default:
-							break;
-						}
-					}
-				}
-				// Send.
-				for (auto& req : sendTcpCopy)
-				{
-					auto it = pool->m_socketId2stream.find(req.m_socketId);
-					if (it == pool->m_socketId2stream.end())
-						continue;
-					Ctcp *tcp = it->second.get();
-					if (!pool->tcpWriteWithTimeout(tcp, &req.m_data, 1))
-						pool->shutdownTcpConnection(tcp);
-				}
-				for (auto& req : sendUdpCopy)
-				{
-					auto it = pool->m_udpServers.find(req.m_socketId);
-					if (it == pool->m_udpServers.end())
-						continue;
-					pool->udpSend(it->second.get(), req.m_remote, &req.m_data, 1);
-				}
-				// Connect.
-				for (auto& req : connectCopy)
-				{
-					Ctcp::ptr tcp = pool->connectTcp(req.m_remote, std::move(req.m_callback));
-					if (tcp)
-						pool->m_connecting.insert(std::make_pair(tcp->getSocketId(), std::move(tcp)));
-				}
-				// Close.
-				for (auto& req : closeCopy)
-				{
-					auto it = pool->m_socketId2stream.find(req.m_socketId);
-					if (it == pool->m_socketId2stream.end())
-						continue;
-					Ctcp *tcp = it->second.get();
-					// No force close means shutdown, and it's a type of send.
-					if (!req.m_bForce && pool->setTcpTimeout(tcp, tcp->getCallback()->getTimeoutSettings().tcp_send_timeout_in_seconds))
-						pool->shutdownTcpConnection(tcp, true); // Timer still working until close, so timeout when shutdown will force close the connection.
-					else
-						pool->shutdownTcpConnection(tcp); // Force close.
-				}
-			}
+				pool->drainCommands(); // Bind, send, connect & close.
 		}));
 		if (!m_wakeup)
 		{
@@ -552,6 +1775,30 @@ namespace NETWORK_POOL
 			m_state = bad;
 			return;
 		}
+		// Never fail.
+		uv_check_init(&m_loop, &m_flushCheck);
+		uv_idle_init(&m_loop, &m_flushIdle);
+		m_flushCheck.data = this;
+		uv_check_start(&m_flushCheck,
+			[](uv_check_t *check)
+		{
+			CnetworkPool *pool = (CnetworkPool *)check->data;
+			pool->flushCorkedTcp();
+			pool->checkMemoryBudget();
+		#ifdef NP_ZEROCOPY
+			if (uv_is_active((const uv_handle_t *)&pool->m_zerocopyTimer))
+				pool->drainZerocopy();
+		#endif
+		});
+		uv_timer_init(&m_loop, &m_budgetTimer);
+		m_budgetTimer.data = this;
+		m_refusal = Ctcp::alloc(this, &m_loop, CtcpCallback::ptr(), SOCKET_ID_UNSPEC); // Refilled when refusing if fail.
+		uv_timer_init(&m_loop, &m_wheelTimer);
+		m_wheelTimer.data = this;
+	#ifdef NP_ZEROCOPY
+		uv_timer_init(&m_loop, &m_zerocopyTimer);
+		m_zerocopyTimer.data = this;
+	#endif
 		m_state = good;
 		uv_run(&m_loop, UV_RUN_DEFAULT);
 		uv_loop_close(&m_loop);
@@ -562,7 +1809,10 @@ namespace NETWORK_POOL
 		// Add map.
 		auto ib = m_socketId2stream.insert(std::make_pair(tcp->getSocketId(), std::forward<Ctcp::ptr>(tcp)));
 		if (ib.second)
+		{
+			++m_connectionNumber;
 			ib.first->second->getCallback()->startup(ib.first->second->getSocketId(), remote);
+		}
 	}
 
 	// This function is idempotent, and can be called any time when tcp is valid(closing is also ok).
@@ -574,9 +1824,41 @@ namespace NETWORK_POOL
 		{
 			Ctcp::ptr tcp(std::move(it->second));
 			m_socketId2stream.erase(it);
-			if (bShutdown)
+			--m_connectionNumber;
+			if (tcp->isWriteBlocked())
+				unblockTcp(tcp.get());
+			// Write corked data before shutdown, or it's dropped when close.
+			// Flush which writes all restarts idle timeout, so shutdown is limited by send timeout again.
+			const bool bGraceful = bShutdown && flushTcp(tcp.get())
+				&& setTcpTimeout(tcp.get(), tcp->getCallback()->getTimeoutSettings().tcp_send_timeout_in_seconds);
+		#ifdef NP_ZEROCOPY
+			if (!m_zerocopy.empty())
+				closeZerocopy(tcp.get(), !bGraceful);
+		#endif
+			if (bGraceful)
+			{
+			#ifdef __linux__
+				// Shutdown after the files.
+				if (!tcp->getFiles().empty())
+				{
+					try
+					{
+						m_closingTcp.insert(std::make_pair(tcp->getSocketId(), std::move(tcp)));
+					}
+					catch (...)
+					{
+						NP_FPRINTF((stderr, "Shutdown tcp error with insufficient memory.\n")); // Closed.
+					}
+					return;
+				}
+			#endif
 				Ctcp::shutdown_and_close(std::move(tcp));
+			}
 			// Or auto free with close.
 		}
+	#ifdef __linux__
+		else if (!m_closingTcp.empty())
+			m_closingTcp.erase(tcp->getSocketId()); // Timeout or error when sending the files, force close.
+	#endif
 	}
 }
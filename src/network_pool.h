@@ -23,45 +23,67 @@
 
 #include <memory>
 #include <deque>
+#include <vector>
 #include <unordered_map>
 #include <mutex>
+#include <atomic>
 #include <thread>
 #include <utility>
 
 #include "uv.h"
+#ifndef _WIN32
+	#include <unistd.h>
+#endif
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+	#define NP_ZEROCOPY 1
+#endif
 
 #include "network_type.h"
 #include "network_node.h"
 #include "uv_wrapper.h"
 #include "network_callback.h"
 #include "buffer.h"
+#include "mpsc_queue.h"
+#include "task.h"
+#include "slot_table.h"
 
 namespace NETWORK_POOL
 {
 	//
 	// Caution! Program may cash when fail to allocate memory in critical step.
 	// So be careful to check memory usage before pushing packet to network pool.
+	// Set write watermarks in preferred_tcp_settings and pause on writeBlocked(Or the bytes sendTcp returns) to bound it,
+	// and set a memory budget of pool to degrade instead of crash under load spike.
 	//
 
 	class CnetworkPool
 	{
 	public:
+		// How connections of bindTcp are spread over loops.
+		enum loop_balance
+		{
+			balance_reuse_port = 0, // Every loop listens with SO_REUSEPORT and the kernel chooses.
+			balance_round_robin, // Loop 0 accepts and hands the socket to loops in turn(Not on Windows).
+			balance_least_connections // Loop 0 accepts and hands the socket to the loop with fewest connections(Not on Windows).
+		};
+
 		struct __write_with_info
 		{
 			uv_write_t write;
 			size_t num;
-			uv_buf_t buf[1]; // Need free when complete request.
+			size_t offset; // Base of the first buffer is moved by offset(Partly written).
+			uv_buf_t buf[1]; // Need release when complete request, followed by __buffer_release of each.
 		};
 		struct __udp_send_with_info
 		{
 			uv_udp_send_t udpSend;
 			size_t num;
-			uv_buf_t buf[1]; // Need free when complete request.
+			uv_buf_t buf[1]; // Need release when complete request, followed by __buffer_release of each.
 		};
 
 	private:
 		// Data which exchanged between internal and external.
-		std::mutex m_lock;
+		std::mutex m_lock; // Only for m_wakeup when exit.
 		struct __pending_bind
 		{
 			CnetworkNode::protocol_type m_protocol;
@@ -73,6 +95,9 @@ namespace NETWORK_POOL
 
 			__pending_bind(const Csockaddr& local, CtcpServerCallback::ptr&& tcpServerCallback)
 				:m_protocol(CnetworkNode::protocol_tcp), m_local(local), m_tcpServerCallback(std::forward<CtcpServerCallback::ptr>(tcpServerCallback)), m_bBind(true), m_socketId(SOCKET_ID_UNSPEC) {}
+			// Join the listener group of socketId on another loop.
+			__pending_bind(const Csockaddr& local, CtcpServerCallback::ptr&& tcpServerCallback, const socket_id socketId)
+				:m_protocol(CnetworkNode::protocol_tcp), m_local(local), m_tcpServerCallback(std::forward<CtcpServerCallback::ptr>(tcpServerCallback)), m_bBind(true), m_socketId(socketId) {}
 			__pending_bind(const Csockaddr& local, CudpCallback::ptr&& udpCallback)
 				:m_protocol(CnetworkNode::protocol_udp), m_local(local), m_udpCallback(std::forward<CudpCallback::ptr>(udpCallback)), m_bBind(true), m_socketId(SOCKET_ID_UNSPEC) {}
 			__pending_bind(const CnetworkNode::protocol_type protocol, socket_id socketId)
@@ -84,7 +109,6 @@ namespace NETWORK_POOL
 			const __pending_bind& operator=(const __pending_bind& another) = delete;
 			const __pending_bind& operator=(__pending_bind&& another) = delete;
 		};
-		std::deque<__pending_bind> m_pendingBind;
 		struct __pending_send_tcp
 		{
 			socket_id m_socketId;
@@ -99,7 +123,44 @@ namespace NETWORK_POOL
 			const __pending_send_tcp& operator=(const __pending_send_tcp& another) = delete;
 			const __pending_send_tcp& operator=(__pending_send_tcp&& another) = delete;
 		};
-		std::deque<__pending_send_tcp> m_pendingSendTcp;
+		struct __pending_send_tcp_fragments
+		{
+			socket_id m_socketId;
+			std::vector<Cbuffer> m_fragments;
+
+			__pending_send_tcp_fragments(const socket_id socketId, std::vector<Cbuffer>&& fragments)
+				:m_socketId(socketId), m_fragments(std::forward<std::vector<Cbuffer>>(fragments)) {}
+
+			__pending_send_tcp_fragments(const __pending_send_tcp_fragments& another) = delete;
+			__pending_send_tcp_fragments(__pending_send_tcp_fragments&& another)
+				:m_socketId(another.m_socketId), m_fragments(std::move(another.m_fragments)) {}
+			const __pending_send_tcp_fragments& operator=(const __pending_send_tcp_fragments& another) = delete;
+			const __pending_send_tcp_fragments& operator=(__pending_send_tcp_fragments&& another) = delete;
+		};
+	#ifndef _WIN32
+		struct __pending_accept
+		{
+			uv_os_sock_t m_socket; // Closed if not taken.
+			CtcpCallback::ptr m_callback;
+
+			__pending_accept(const uv_os_sock_t socket, CtcpCallback::ptr&& callback)
+				:m_socket(socket), m_callback(std::forward<CtcpCallback::ptr>(callback)) {}
+			~__pending_accept()
+			{
+				if (m_socket >= 0)
+					::close(m_socket);
+			}
+
+			__pending_accept(const __pending_accept& another) = delete;
+			__pending_accept(__pending_accept&& another)
+				:m_socket(another.m_socket), m_callback(std::move(another.m_callback))
+			{
+				another.m_socket = -1;
+			}
+			const __pending_accept& operator=(const __pending_accept& another) = delete;
+			const __pending_accept& operator=(__pending_accept&& another) = delete;
+		};
+	#endif
 		struct __pending_send_udp
 		{
 			socket_id m_socketId;
@@ -115,7 +176,6 @@ namespace NETWORK_POOL
 			const __pending_send_udp& operator=(const __pending_send_udp& another) = delete;
 			const __pending_send_udp& operator=(__pending_send_udp&& another) = delete;
 		};
-		std::deque<__pending_send_udp> m_pendingSendUdp;
 		struct __pending_connect
 		{
 			Csockaddr m_remote;
@@ -130,7 +190,32 @@ namespace NETWORK_POOL
 			const __pending_connect& operator=(const __pending_connect& another) = delete;
 			const __pending_connect& operator=(__pending_connect&& another) = delete;
 		};
-		std::deque<__pending_connect> m_pendingConnect;
+	#ifdef __linux__
+		struct __pending_send_file
+		{
+			socket_id m_socketId;
+			int m_fd; // Closed if not taken.
+			int64_t m_offset;
+			size_t m_length;
+
+			__pending_send_file(const socket_id socketId, const int fd, const int64_t offset, const size_t length)
+				:m_socketId(socketId), m_fd(fd), m_offset(offset), m_length(length) {}
+			~__pending_send_file()
+			{
+				if (m_fd >= 0)
+					::close(m_fd);
+			}
+
+			__pending_send_file(const __pending_send_file& another) = delete;
+			__pending_send_file(__pending_send_file&& another)
+				:m_socketId(another.m_socketId), m_fd(another.m_fd), m_offset(another.m_offset), m_length(another.m_length)
+			{
+				another.m_fd = -1;
+			}
+			const __pending_send_file& operator=(const __pending_send_file& another) = delete;
+			const __pending_send_file& operator=(__pending_send_file&& another) = delete;
+		};
+	#endif
 		struct __pending_close
 		{
 			socket_id m_socketId;
@@ -145,22 +230,200 @@ namespace NETWORK_POOL
 			const __pending_close& operator=(const __pending_close& another) = delete;
 			const __pending_close& operator=(__pending_close&& another) = delete;
 		};
-		std::deque<__pending_close> m_pendingClose;
+
+		// Task to schedule(Delay and id), cancel(Id) or post(Task).
+		struct __pending_task
+		{
+			timer_id m_timerId;
+			uint64_t m_delayInMs;
+			Ctask::ptr m_task;
+
+			__pending_task(const timer_id timerId, const uint64_t delayInMs, Ctask::ptr&& task)
+				:m_timerId(timerId), m_delayInMs(delayInMs), m_task(std::forward<Ctask::ptr>(task)) {}
+
+			__pending_task(const __pending_task& another) = delete;
+			__pending_task(__pending_task&& another)
+				:m_timerId(another.m_timerId), m_delayInMs(another.m_delayInMs), m_task(std::move(another.m_task)) {}
+			const __pending_task& operator=(const __pending_task& another) = delete;
+			const __pending_task& operator=(__pending_task&& another) = delete;
+		};
+
+		// Command from other threads, the node is from slab and freed by internal thread.
+		enum __command_type
+		{
+			command_bind = 0,
+			command_send_tcp,
+			command_send_tcp_fragments,
+			command_send_udp,
+			command_connect,
+			command_close,
+			command_accept,
+			command_send_file,
+			command_schedule,
+			command_cancel,
+			command_post
+		};
+		struct __command : public __mpsc_node
+		{
+			__command_type m_type;
+
+			__command(const __command_type type)
+				:m_type(type) {}
+		};
+		template<class T>
+		struct __command_node : public __command, public CslabAllocator<__command_node<T>>
+		{
+			T m_data;
+
+			__command_node(const __command_type type, T&& data)
+				:__command(type), m_data(std::forward<T>(data)) {}
+		};
+		CmpscQueue m_commands;
+		std::atomic<bool> m_draining; // Internal thread is draining, so producer needn't wake it up.
+		// Budget of commands executed in one loop iteration, only valid in main.
+		std::atomic<size_t> m_budgetOperations;
+		std::atomic<size_t> m_budgetBytes;
+		// Budget of memory used by allocator(Send buffers, commands and receive buffers from __alloc), only valid in main.
+		// Any loop samples the usage at most every 10ms, and each sample over budget starts a new epoch.
+		std::atomic<size_t> m_memoryBudget;
+		std::atomic<bool> m_overBudget;
+		std::atomic<uint64_t> m_budgetSampleTime;
+		std::atomic<size_t> m_budgetEpoch;
+		// Connections of this loop whose reading is paused by budget, and the epoch last paused in.
+		std::vector<socket_id> m_pausedTcp;
+		size_t m_pauseEpoch;
+		uv_timer_t m_budgetTimer; // Sample while over budget, or an idle loop never sees it's back.
+		Ctcp::ptr m_refusal; // Spare to accept and close a refused connection, so listen never stalls for memory.
+
+		// Loops of the pool, the one created by user is the main(Loop 0) and owns the others.
+		// Set in constructor and read only after that.
+		CnetworkPool *m_main;
+		size_t m_index;
+		std::vector<CnetworkPool *> m_loops; // Only valid in main.
+		std::vector<std::unique_ptr<CnetworkPool>> m_shards; // Only valid in main.
+		std::atomic<size_t> m_nextLoop; // Round-robin for connect and udp bind.
+		loop_balance m_balance;
+		std::atomic<size_t> m_connectionNumber; // Connections of this loop(Include the ones handed to it).
+		// Queued bytes of blocked tcp published for sender of other threads, lock only when any is blocked.
+		std::mutex m_blockedLock;
+		std::unordered_map<socket_id, size_t> m_blockedTcp;
+		std::atomic<size_t> m_blockedTcpNumber;
+		std::atomic<timer_id> m_timerIdCounter; // Id of timer is taken by caller before the loop gets it.
 		
 		//
 		// Following data must be accessed by internal thread.
 		//
 
-		// Counter to get next socket id.
-		socket_id m_socketIdCounter;
+		// Slot and generation of socket id(Index of loop in low bits).
+		CslotAllocator m_slots;
+
+		// Drained commands wait in lanes and are executed round-robin, so a burst of one type can't starve the others.
+		// Close is in the lane of tcp send to keep the order, and cancel is in the lane of schedule.
+		struct __command_lane
+		{
+			__command *m_head;
+			__command *m_tail;
+
+			__command_lane()
+				:m_head(nullptr), m_tail(nullptr) {}
+
+			inline void push(__command * const command)
+			{
+				command->m_next.store(nullptr, std::memory_order_relaxed);
+				if (nullptr == m_tail)
+					m_head = command;
+				else
+					m_tail->m_next.store(command, std::memory_order_relaxed);
+				m_tail = command;
+			}
+			inline __command *pop()
+			{
+				__command *command = m_head;
+				if (command != nullptr)
+				{
+					m_head = static_cast<__command *>(command->m_next.load(std::memory_order_relaxed));
+					if (nullptr == m_head)
+						m_tail = nullptr;
+				}
+				return command;
+			}
+			inline bool empty() const
+			{
+				return nullptr == m_head;
+			}
+		};
+		enum __lane_type
+		{
+			lane_control = 0, // Bind, connect and accept.
+			lane_tcp,
+			lane_udp,
+			lane_task, // Schedule, cancel and post.
+			lane_number
+		};
+		__command_lane m_lanes[lane_number];
+		size_t m_nextLane;
 
 		// Loop must be initialized in internal work thread.
 		uv_loop_t m_loop;
 		Casync::ptr m_wakeup;
+		// Listeners of a group share the socket id of the main one, so servers of tcp stay in a hash map.
 		std::unordered_map<socket_id, CtcpServer::ptr> m_tcpServers;
-		std::unordered_map<socket_id, Cudp::ptr> m_udpServers;
-		std::unordered_map<socket_id, Ctcp::ptr> m_socketId2stream;
-		std::unordered_map<socket_id, Ctcp::ptr> m_connecting;
+		CslotMap<Cudp::ptr> m_udpServers;
+		CslotMap<Ctcp::ptr> m_socketId2stream;
+		CslotMap<Ctcp::ptr> m_connecting;
+		// Timeout of tcp in a timing wheel of coarse tick, driven by one timer which only runs while any waits.
+		static const uint64_t s_wheelTickInMs = 100;
+		CtimingWheel m_wheel;
+		uv_timer_t m_wheelTimer;
+		// Task scheduled on this loop waits in a wheel of its own, driven by the same timer.
+		struct __timer
+		{
+			__wheel_node m_node;
+			timer_id m_timerId;
+			uint64_t m_deadline;
+			Ctask::ptr m_task;
+
+			__timer()
+				:m_timerId(TIMER_ID_UNSPEC), m_deadline(0) {}
+			~__timer()
+			{
+				m_node.unlink();
+			}
+
+			// No copy, no move.
+			__timer(const __timer& another) = delete;
+			__timer(__timer&& another) = delete;
+			const __timer& operator=(const __timer& another) = delete;
+			const __timer& operator=(__timer&& another) = delete;
+		};
+		CtimingWheel m_taskWheel;
+		std::unordered_map<timer_id, __timer> m_timers;
+		// Tcp with corked data, flushed in check phase of every loop iteration(Idle keeps poll from blocking meanwhile).
+		std::vector<socket_id> m_corkedTcp;
+		uv_check_t m_flushCheck;
+		uv_idle_t m_flushIdle;
+	#ifdef __linux__
+		std::unordered_map<socket_id, Ctcp::ptr> m_closingTcp; // Shutdown after the files queued.
+	#endif
+	#ifdef NP_ZEROCOPY
+		// Buffers sent with MSG_ZEROCOPY are held until the kernel reports completion on the error queue.
+		struct __zerocopy_buffer
+		{
+			uint32_t m_seq; // Counter of sendmsg.
+			bool m_bDone;
+			uv_buf_t m_buf;
+			__buffer_release m_release;
+		};
+		struct __zerocopy_socket
+		{
+			int m_fd; // Duplicated to read the error queue, it keeps the socket after close until all done. -1 if not supported.
+			uint32_t m_nextSeq;
+			uint64_t m_closeDeadline; // Not 0 after connection closed, force close and release when loop time passes it.
+			std::deque<__zerocopy_buffer> m_buffers;
+		};
+		std::unordered_map<socket_id, __zerocopy_socket> m_zerocopy;
+		uv_timer_t m_zerocopyTimer; // Drain completion while no I/O wakes the loop.
+	#endif
 
 		// Status of internal thread.
 		volatile enum __internal_state
@@ -169,15 +432,59 @@ namespace NETWORK_POOL
 			good,
 			bad
 		} m_state;
-		bool m_bWantExit;
+		std::atomic<bool> m_bWantExit;
+		std::atomic<size_t> m_waking; // Producers in wakeup, exit waits for them before freeing the async.
 
 		// Internal thread.
 		std::unique_ptr<std::thread> m_thread;
 
 		bool setTcpTimeout(Ctcp * const tcp, const unsigned int timeout_in_seconds);
+		bool wheelAdd(CtimingWheel& wheel, __wheel_node * const node, const uint64_t deadline);
+		void expireTimeouts();
+		bool addTimer(const timer_id timerId, const uint64_t delayInMs, Ctask::ptr&& task);
+		bool cancelTimer(const timer_id timerId); // Return false if not found.
 		bool tcpReadWithTimeout(Ctcp * const tcp);
-		bool tcpWriteWithTimeout(Ctcp * const tcp, Cbuffer * const data, const size_t number);
-		CtcpServer::ptr bindAndListenTcp(const Csockaddr& local, CtcpServerCallback::ptr&& callback);
+		bool tcpReadStart(Ctcp * const tcp);
+		inline bool overBudget() const
+		{
+			return m_main->m_overBudget.load(std::memory_order_relaxed);
+		}
+		void checkMemoryBudget(); // Sample usage, then pause or resume reading.
+		void refuseTcp(uv_stream_t * const server);
+		void pauseLargestTcp();
+		void resumePausedTcp();
+		bool tcpWriteWithTimeout(Ctcp * const tcp, uv_buf_t * const buf, __buffer_release * const release, const size_t number); // Take the buffers.
+		bool tcpCork(Ctcp * const tcp, Cbuffer * const data, const size_t number);
+		inline size_t tcpQueuedBytes(Ctcp * const tcp)
+		{
+			return tcp->corkBytes() + uv_stream_get_write_queue_size(tcp->getStream());
+		}
+		void checkTcpWatermark(Ctcp * const tcp); // Notify writeBlocked or writable.
+		void unblockTcp(Ctcp * const tcp); // Unpublish when closed.
+		size_t blockedQueuedBytes(const socket_id socketId);
+		bool flushTcp(Ctcp * const tcp);
+		void flushCorkedTcp();
+	#ifdef __linux__
+		bool tcpSendFile(Ctcp * const tcp, const int fd, const int64_t offset, const size_t length); // Take the fd.
+		bool startTcpFile(Ctcp * const tcp);
+		bool pollTcpFile(Ctcp * const tcp);
+		bool continueTcpFile(Ctcp * const tcp);
+	#endif
+	#ifdef NP_ZEROCOPY
+		// Return false if not sent(Not supported or error), or 'taken' is the number of buffers held.
+		bool zerocopyWrite(Ctcp * const tcp, uv_buf_t * const buf, __buffer_release * const release, const size_t number, size_t& taken);
+		void drainZerocopy(const bool bExit = false);
+		void closeZerocopy(Ctcp * const tcp, const bool bForce);
+	#endif
+		// Join the listener group of socketId with SO_REUSEPORT if socketId is not SOCKET_ID_UNSPEC.
+		CtcpServer::ptr bindAndListenTcp(const Csockaddr& local, CtcpServerCallback::ptr&& callback, const socket_id socketId = SOCKET_ID_UNSPEC);
+		// Listen on every loop with SO_REUSEPORT, let the kernel spread the connections.
+		void bindAndListenTcpGroup(const Csockaddr& local, CtcpServerCallback::ptr&& callback);
+	#ifndef _WIN32
+		// Accept on this loop and hand the socket to loop.
+		void acceptToLoop(uv_stream_t * const server, CnetworkPool * const loop, CtcpCallback::ptr&& callback);
+		void openTcpConnection(const uv_os_sock_t socket, CtcpCallback::ptr&& callback);
+	#endif
 		Ctcp::ptr connectTcp(const Csockaddr& remote, CtcpCallback::ptr&& callback);
 
 		bool udpSend(Cudp * const udp, const Csockaddr& remote, Cbuffer * const data, const size_t number);
@@ -189,26 +496,99 @@ namespace NETWORK_POOL
 		void startupTcpConnection(Ctcp::ptr&& tcp, const Csockaddr& remote);
 		void shutdownTcpConnection(Ctcp * const tcp, const bool bShutdown = false);
 
-		void bind(__pending_bind&& req)
+		// Return SOCKET_ID_UNSPEC when slots of this loop are used up, the slot is released with the wrapper.
+		inline socket_id nextSocketId()
+		{
+			return m_slots.alloc();
+		}
+		friend void __release_socket_id(CnetworkPool * const pool, const socket_id socketId);
+		// Loop which owns the socket, nullptr if invalid.
+		inline CnetworkPool *route(const socket_id socketId) const
 		{
+			const size_t index = SOCKET_ID_LOOP(socketId);
+			return index < m_main->m_loops.size() ? m_main->m_loops[index] : nullptr;
+		}
+		inline CnetworkPool *nextLoop()
+		{
+			return m_main->m_loops[m_main->m_nextLoop++ % m_main->m_loops.size()];
+		}
+		// Loop of the socket if given, or the loop calling, or next loop.
+		CnetworkPool *taskLoop(const socket_id socketId)
+		{
+			if (socketId != SOCKET_ID_UNSPEC)
+				return route(socketId);
+			const std::thread::id id = std::this_thread::get_id();
+			for (const auto loop : m_main->m_loops)
 			{
-				std::lock_guard<std::mutex> guard(m_lock); // Use guard in case of exception.
-				m_pendingBind.push_back(std::forward<__pending_bind>(req));
+				if (loop->m_thread->get_id() == id)
+					return loop;
 			}
-			uv_async_send(m_wakeup->getAsync());
+			return nextLoop();
 		}
+		// Loop for the connection accepted, nullptr means the accepting loop.
+		CnetworkPool *balanceLoop()
+		{
+			if (m_main->m_loops.size() <= 1)
+				return nullptr;
+			switch (m_main->m_balance)
+			{
+			case balance_round_robin:
+				return nextLoop();
 
-	public:
-		// Throw when fail.
-		CnetworkPool()
-			:m_socketIdCounter(0), m_state(initializing), m_bWantExit(false), m_thread(new std::thread(&CnetworkPool::internalThread, this))
+			case balance_least_connections:
+			{
+				CnetworkPool *best = m_main;
+				for (const auto& loop : m_main->m_loops)
+				{
+					if (loop->m_connectionNumber < best->m_connectionNumber)
+						best = loop;
+				}
+				return best;
+			}
+
+			default:
+				return nullptr;
+			}
+		}
+
+		// Loop owned by main.
+		CnetworkPool(CnetworkPool * const main, const size_t index)
+			:m_draining(false), m_budgetOperations(main->m_budgetOperations.load()), m_budgetBytes(main->m_budgetBytes.load()), m_memoryBudget(0), m_overBudget(false), m_budgetSampleTime(0), m_budgetEpoch(0), m_pauseEpoch(0), m_main(main), m_index(index), m_nextLoop(0), m_balance(main->m_balance), m_connectionNumber(0), m_blockedTcpNumber(0), m_timerIdCounter(0), m_slots(index), m_nextLane(0), m_state(initializing), m_bWantExit(false), m_waking(0), m_thread(new std::thread(&CnetworkPool::internalThread, this))
+		{
+			waitStartup();
+		}
+		void waitStartup()
 		{
 			while (initializing == m_state)
 				std::this_thread::yield();
 			if (m_state != good)
+			{
+				m_thread->join();
 				throw(-1);
+			}
 		}
-		~CnetworkPool()
+		// Throw when fail to allocate.
+		template<class T>
+		void command(const __command_type type, T&& data)
+		{
+			m_commands.push(new __command_node<T>(type, std::forward<T>(data)));
+			if (!m_draining)
+				wakeup();
+		}
+		// Command pushed after exit is freed by stop.
+		inline void wakeup()
+		{
+			++m_waking;
+			if (!m_bWantExit)
+				uv_async_send(m_wakeup->getAsync());
+			--m_waking;
+		}
+		bool lanesEmpty() const;
+		void drainCommands();
+		void executeCommand(__command * const command);
+		static void freeCommand(__command * const command);
+
+		void requestExit()
 		{
 			m_bWantExit = true;
 			// Use lock to keep safe.
@@ -216,39 +596,137 @@ namespace NETWORK_POOL
 			if (m_wakeup)
 				uv_async_send(m_wakeup->getAsync());
 			m_lock.unlock();
-			m_thread->join();
+		}
+		void stop()
+		{
+			requestExit();
+			if (m_thread->joinable())
+				m_thread->join();
+			// Command pushed after exit.
+			__mpsc_node *node;
+			while ((node = m_commands.pop()) != nullptr)
+				freeCommand(static_cast<__command *>(node));
+		}
+		// Loops route to each other, so every loop exits and joins before any member is freed.
+		void stopLoops()
+		{
+			for (const auto& shard : m_shards)
+				shard->requestExit();
+			requestExit();
+			for (const auto& shard : m_shards)
+				shard->stop();
+			stop();
+			m_shards.clear();
+		}
+
+		void bind(__pending_bind&& req)
+		{
+			command(command_bind, std::forward<__pending_bind>(req));
+		}
+
+	public:
+		// Throw when fail.
+		// Run loopNumber event loops(At most 256), each on its own thread and owns its connections.
+		// Callbacks of different connections may be called concurrently when more than 1 loop.
+		CnetworkPool(const size_t loopNumber = 1, const loop_balance balance = balance_reuse_port)
+			:m_draining(false), m_budgetOperations(4096), m_budgetBytes(0x400000), m_memoryBudget(0), m_overBudget(false), m_budgetSampleTime(0), m_budgetEpoch(0), m_pauseEpoch(0), m_main(this), m_index(0), m_nextLoop(0), m_balance(balance), m_connectionNumber(0), m_blockedTcpNumber(0), m_timerIdCounter(0), m_slots(0), m_nextLane(0), m_state(initializing), m_bWantExit(false), m_waking(0), m_thread(new std::thread(&CnetworkPool::internalThread, this))
+		{
+			waitStartup();
+			try
+			{
+				m_loops.push_back(this);
+				for (size_t i = 1; i < loopNumber && i <= SOCKET_ID_LOOP_MASK; ++i)
+				{
+					std::unique_ptr<CnetworkPool> shard(new CnetworkPool(this, i));
+					m_loops.push_back(shard.get());
+					m_shards.push_back(std::move(shard));
+				}
+			}
+			catch (...)
+			{
+				stopLoops();
+				throw;
+			}
+		}
+		~CnetworkPool()
+		{
+			stopLoops();
 		}
 
+		size_t getLoopNumber() const
+		{
+			return m_main->m_loops.size();
+		}
+
+		// Each loop executes at most this many commands(And bytes of send) from other threads in one iteration,
+		// the rest resume after the I/O and timers of next iteration. Default 4096 and 4MB, 0 means no limit.
+		void setDrainBudget(const size_t operations, const size_t bytes)
+		{
+			m_main->m_budgetOperations = operations;
+			m_main->m_budgetBytes = bytes;
+		}
+
+		// Bytes the allocator may use(Usage of __get_usage_data), 0 means no limit(Default). When over it,
+		// sends are dropped(Notify drop and shut down tcp, or udp sendError), new connections are closed at once, and reading of the connections
+		// which queue most is paused until usage falls below 7/8 of it.
+		void setMemoryBudget(const size_t bytes)
+		{
+			m_main->m_memoryBudget = bytes;
+		}
+		bool isOverBudget() const
+		{
+			return overBudget();
+		}
+
+		// Prefill the cache of connection and write request, call it at startup to absorb the first burst.
+		static size_t prefillCache(const size_t connectionNumber, const bool bTouch = true);
+
 		// No copy, no move.
 		CnetworkPool(const CnetworkPool& another) = delete;
 		CnetworkPool(CnetworkPool&& another) = delete;
 		const CnetworkPool& operator=(const CnetworkPool& another) = delete;
 		const CnetworkPool& operator=(CnetworkPool&& another) = delete;
 
+		// With more than 1 loop and balance_reuse_port, every loop listens on local(Same port) with SO_REUSEPORT,
+		// and callback's newTcpCallback may be called concurrently. Startup and shutdown are called once.
+		// Other balance listens on loop 0 only, newTcpCallback is called there and the connection runs on the chosen loop.
 		void bindTcp(const Csockaddr& local, CtcpServerCallback::ptr&& callback)
 		{
 			if (callback)
-				bind(std::move(__pending_bind(local, std::forward<CtcpServerCallback::ptr>(callback))));
+				m_main->bind(std::move(__pending_bind(local, std::forward<CtcpServerCallback::ptr>(callback))));
 		}
 		void unbindTcp(const socket_id socketId)
 		{
-			bind(std::move(__pending_bind(CnetworkNode::protocol_tcp, socketId)));
+			CnetworkPool *pool = route(socketId);
+			if (pool != nullptr)
+				pool->bind(std::move(__pending_bind(CnetworkNode::protocol_tcp, socketId)));
 		}
 
 		void bindUdp(const Csockaddr& local, CudpCallback::ptr&& callback)
 		{
 			if (callback)
-				bind(std::move(__pending_bind(local, std::forward<CudpCallback::ptr>(callback))));
+				nextLoop()->bind(std::move(__pending_bind(local, std::forward<CudpCallback::ptr>(callback))));
 		}
 		void unbindUdp(const socket_id socketId)
 		{
-			bind(std::move(__pending_bind(CnetworkNode::protocol_udp, socketId)));
+			CnetworkPool *pool = route(socketId);
+			if (pool != nullptr)
+				pool->bind(std::move(__pending_bind(CnetworkNode::protocol_udp, socketId)));
 		}
 
-		void sendTcp(const socket_id socketId, Cbuffer&& data, bool bAllowDirectCall = true)
+		// Use Cbuffer::borrow to send memory of caller without copy.
+		// Return bytes queued on the connection after direct send, or the queued bytes of a blocked connection(0 if not blocked)
+		// when sent from other thread. Pause sending when it's over your limit.
+		size_t sendTcp(const socket_id socketId, Cbuffer&& data, bool bAllowDirectCall = true)
 		{
 			if (SOCKET_ID_UNSPEC == socketId || 0 == data.getLength())
-				return;
+				return 0;
+			CnetworkPool *pool = route(socketId);
+			if (pool != this)
+			{
+				// Owned by another loop.
+				return nullptr == pool ? 0 : pool->sendTcp(socketId, std::forward<Cbuffer>(data), bAllowDirectCall);
+			}
 			if (bAllowDirectCall && std::this_thread::get_id() == m_thread->get_id())
 			{
 				// Direct send.
@@ -256,31 +734,98 @@ namespace NETWORK_POOL
 				if (it != m_socketId2stream.end())
 				{
 					Ctcp *tcp = it->second.get();
-					if (!tcpWriteWithTimeout(tcp, &data, 1))
-						shutdownTcpConnection(tcp);
+					if (tcpCork(tcp, &data, 1))
+						return tcpQueuedBytes(tcp);
+					shutdownTcpConnection(tcp);
 				}
+				return 0;
 			}
-			else
+			command(command_send_tcp, __pending_send_tcp(socketId, std::forward<Cbuffer>(data)));
+			return blockedQueuedBytes(socketId);
+		}
+		// Fragments(Owned or borrowed) are written in order by one writev.
+		size_t sendTcp(const socket_id socketId, std::vector<Cbuffer>&& fragments, bool bAllowDirectCall = true)
+		{
+			if (SOCKET_ID_UNSPEC == socketId || fragments.empty())
+				return 0;
+			CnetworkPool *pool = route(socketId);
+			if (pool != this)
 			{
-				__pending_send_tcp temp(socketId, std::forward<Cbuffer>(data));
+				// Owned by another loop.
+				return nullptr == pool ? 0 : pool->sendTcp(socketId, std::forward<std::vector<Cbuffer>>(fragments), bAllowDirectCall);
+			}
+			if (bAllowDirectCall && std::this_thread::get_id() == m_thread->get_id())
+			{
+				// Direct send.
+				auto it = m_socketId2stream.find(socketId);
+				if (it != m_socketId2stream.end())
 				{
-					std::lock_guard<std::mutex> guard(m_lock); // Use guard in case of exception.
-					m_pendingSendTcp.push_back(std::move(temp));
+					Ctcp *tcp = it->second.get();
+					if (tcpCork(tcp, fragments.data(), fragments.size()))
+						return tcpQueuedBytes(tcp);
+					shutdownTcpConnection(tcp);
 				}
-				uv_async_send(m_wakeup->getAsync());
+				return 0;
 			}
+			command(command_send_tcp_fragments, __pending_send_tcp_fragments(socketId, std::forward<std::vector<Cbuffer>>(fragments)));
+			return blockedQueuedBytes(socketId);
 		}
-		void sendTcp(const socket_id socketId, const void *data, const size_t length, bool bAllowDirectCall = true)
+		size_t sendTcp(const socket_id socketId, const void *data, const size_t length, bool bAllowDirectCall = true)
 		{
 			if (SOCKET_ID_UNSPEC == socketId || 0 == length || nullptr == data)
-				return;
+				return 0;
 			Cbuffer buf(data, length);
-			sendTcp(socketId, std::move(buf), bAllowDirectCall);
+			return sendTcp(socketId, std::move(buf), bAllowDirectCall);
+		}
+	#ifdef __linux__
+		// Send 'length' bytes of file from 'offset' by sendfile in order with other sends, file data never enters user space.
+		// The fd is duplicated so caller can close it after call, return false if fail to duplicate.
+		// No drop notification for file, and the connection is closed if the file is shorter than 'length'.
+		bool sendFile(const socket_id socketId, const int fd, const int64_t offset, const size_t length, bool bAllowDirectCall = true)
+		{
+			if (SOCKET_ID_UNSPEC == socketId || fd < 0 || offset < 0 || 0 == length)
+				return false;
+			CnetworkPool *pool = route(socketId);
+			if (pool != this)
+			{
+				// Owned by another loop.
+				return pool != nullptr && pool->sendFile(socketId, fd, offset, length, bAllowDirectCall);
+			}
+			const int file = dup(fd);
+			if (file < 0)
+				return false;
+			if (bAllowDirectCall && std::this_thread::get_id() == m_thread->get_id())
+			{
+				// Direct send.
+				auto it = m_socketId2stream.find(socketId);
+				if (it != m_socketId2stream.end())
+				{
+					Ctcp *tcp = it->second.get();
+					if (!tcpSendFile(tcp, file, offset, length))
+						shutdownTcpConnection(tcp);
+				}
+				else
+					::close(file);
+			}
+			else
+			{
+				command(command_send_file, __pending_send_file(socketId, file, offset, length));
+			}
+			return true;
 		}
+	#endif
 		void sendUdp(const socket_id socketId, const Csockaddr& remote, Cbuffer&& data, bool bAllowDirectCall = true)
 		{
 			if (SOCKET_ID_UNSPEC == socketId || 0 == data.getLength() || data.getLength() > 65507)
 				return;
+			CnetworkPool *pool = route(socketId);
+			if (pool != this)
+			{
+				// Owned by another loop.
+				if (pool != nullptr)
+					pool->sendUdp(socketId, remote, std::forward<Cbuffer>(data), bAllowDirectCall);
+				return;
+			}
 			if (bAllowDirectCall && std::this_thread::get_id() == m_thread->get_id())
 			{
 				auto it = m_udpServers.find(socketId);
@@ -289,12 +834,7 @@ namespace NETWORK_POOL
 			}
 			else
 			{
-				__pending_send_udp temp(socketId, remote, std::forward<Cbuffer>(data));
-				{
-					std::lock_guard<std::mutex> guard(m_lock); // Use guard in case of exception.
-					m_pendingSendUdp.push_back(std::move(temp));
-				}
-				uv_async_send(m_wakeup->getAsync());
+				command(command_send_udp, __pending_send_udp(socketId, remote, std::forward<Cbuffer>(data)));
 			}
 		}
 		void sendUdp(const socket_id socketId, const Csockaddr& remote, const void *data, const size_t length, bool bAllowDirectCall = true)
@@ -313,24 +853,61 @@ namespace NETWORK_POOL
 		{
 			if (!callback)
 				return;
-			__pending_connect temp(remote, std::forward<CtcpCallback::ptr>(callback));
-			{
-				std::lock_guard<std::mutex> guard(m_lock); // Use guard in case of exception.
-				m_pendingConnect.push_back(std::move(temp));
-			}
-			uv_async_send(m_wakeup->getAsync());
+			nextLoop()->command(command_connect, __pending_connect(remote, std::forward<CtcpCallback::ptr>(callback)));
 		}
 
 		// It waits for pending write requests to complete if bForceClose == false.
 		// Or close immediately if bForceClose == true.
 		void close(const socket_id socketId, const bool bForceClose = false)
 		{
-			__pending_close temp(socketId, bForceClose);
-			{
-				std::lock_guard<std::mutex> guard(m_lock); // Use guard in case of exception.
-				m_pendingClose.push_back(std::move(temp));
-			}
-			uv_async_send(m_wakeup->getAsync());
+			CnetworkPool *pool = route(socketId);
+			if (nullptr == pool)
+				return;
+			pool->command(command_close, __pending_close(socketId, bForceClose));
+		}
+
+		//
+		// Following function(s) run task on loop thread.
+		// Task runs on the loop of 'socketId' if given(Nothing if invalid), or the loop calling, or loops in round-robin.
+		//
+
+		// Run task once after delay(From when the loop takes it, in coarse tick of timing wheel but never earlier).
+		// Return id to cancel, or TIMER_ID_UNSPEC if fail. Outstanding timers cost O(1) each in a timing wheel.
+		timer_id schedule(const uint64_t delayInMs, Ctask::ptr&& task, const socket_id socketId = SOCKET_ID_UNSPEC)
+		{
+			if (!task)
+				return TIMER_ID_UNSPEC;
+			CnetworkPool *pool = taskLoop(socketId);
+			if (nullptr == pool)
+				return TIMER_ID_UNSPEC;
+			const timer_id timerId = (++pool->m_timerIdCounter << SOCKET_ID_LOOP_BITS) | pool->m_index;
+			if (std::this_thread::get_id() == pool->m_thread->get_id())
+				return pool->addTimer(timerId, delayInMs, std::forward<Ctask::ptr>(task)) ? timerId : TIMER_ID_UNSPEC;
+			pool->command(command_schedule, __pending_task(timerId, delayInMs, std::forward<Ctask::ptr>(task)));
+			return timerId;
+		}
+		// Free the task if not run yet, at once on the loop thread of timer, or else it races with the expiry.
+		void cancel(const timer_id timerId)
+		{
+			if (TIMER_ID_UNSPEC == timerId)
+				return;
+			CnetworkPool *pool = route(timerId);
+			if (nullptr == pool)
+				return;
+			if (std::this_thread::get_id() == pool->m_thread->get_id() && pool->cancelTimer(timerId))
+				return;
+			// Schedule from another thread may be still queued, so cancel behind it in the same lane(Nothing if run).
+			pool->command(command_cancel, __pending_task(timerId, 0, Ctask::ptr()));
+		}
+		// Run task in the batch of commands drained by the loop(Never inline, even when called on the loop thread).
+		void post(Ctask::ptr&& task, const socket_id socketId = SOCKET_ID_UNSPEC)
+		{
+			if (!task)
+				return;
+			CnetworkPool *pool = taskLoop(socketId);
+			if (nullptr == pool)
+				return;
+			pool->command(command_post, __pending_task(TIMER_ID_UNSPEC, 0, std::forward<Ctask::ptr>(task)));
 		}
 	};
 }
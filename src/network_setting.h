@@ -21,6 +21,8 @@
 
 #pragma once
 
+#include <cstddef>
+
 namespace NETWORK_POOL
 {
 	struct preferred_tcp_server_settings
@@ -44,6 +46,13 @@ namespace NETWORK_POOL
 		// Note: Linux will set double the size of the original set value.
 		int tcp_send_buffer_size;
 		int tcp_recv_buffer_size;
+		// Send with MSG_ZEROCOPY(Linux only) when the data of a flush is no smaller than this, 0 means never.
+		// Memory is held until the kernel reports completion, so copy is cheaper for small data(Below about 64KB).
+		size_t tcp_zerocopy_threshold;
+		// Bytes queued to write(Corked and in write queue, not include files), 0 high watermark means no limit.
+		// writeBlocked is notified when queued reaches high watermark, and writable when it falls to low watermark.
+		size_t tcp_write_high_watermark;
+		size_t tcp_write_low_watermark;
 
 		preferred_tcp_settings()
 		{
@@ -52,6 +61,9 @@ namespace NETWORK_POOL
 			tcp_keepalive_time_in_seconds = 30;
 			tcp_send_buffer_size = 0;
 			tcp_recv_buffer_size = 0;
+			tcp_zerocopy_threshold = 0;
+			tcp_write_high_watermark = 0;
+			tcp_write_low_watermark = 0;
 		}
 	};
 
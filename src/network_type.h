@@ -25,6 +25,22 @@
 
 namespace NETWORK_POOL
 {
-	typedef uint64_t socket_id; // Never overlap.
+	typedef uint64_t socket_id; // Never overlap(See CslotAllocator).
 	#define SOCKET_ID_UNSPEC (0)
+
+	// Low bits of socket id is the index of the loop which owns it.
+	#define SOCKET_ID_LOOP_BITS (8)
+	#define SOCKET_ID_LOOP_MASK ((socket_id)((1 << SOCKET_ID_LOOP_BITS) - 1))
+	#define SOCKET_ID_LOOP(_id) ((size_t)((_id) & SOCKET_ID_LOOP_MASK))
+
+	// Then the slot in tables of the loop, and the generation of the slot in high bits.
+	#define SOCKET_ID_SLOT_BITS (20)
+	#define SOCKET_ID_SLOT_NUMBER ((size_t)1 << SOCKET_ID_SLOT_BITS)
+	#define SOCKET_ID_SLOT(_id) ((size_t)(((_id) >> SOCKET_ID_LOOP_BITS) & (SOCKET_ID_SLOT_NUMBER - 1)))
+	#define SOCKET_ID_GENERATION_SHIFT (SOCKET_ID_LOOP_BITS + SOCKET_ID_SLOT_BITS)
+	#define SOCKET_ID_GENERATION_MASK (((socket_id)1 << (64 - SOCKET_ID_GENERATION_SHIFT)) - 1)
+	#define SOCKET_ID_GENERATION(_id) ((_id) >> SOCKET_ID_GENERATION_SHIFT)
+
+	typedef uint64_t timer_id; // Never overlap, index of loop in low bits like socket id.
+	#define TIMER_ID_UNSPEC (0)
 }
@@ -0,0 +1,131 @@
+/* Copyright (c) 2018 Zhenyu Zhang. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#include "mt_shared_ptr.h"
+
+namespace NETWORK_POOL
+{
+	//
+	// Recycle constructed objects, so their vectors and buffers keep the warmed-up capacity.
+	// T should have a default constructor and 'void recycle()', which resets it for reuse.
+	// Object can be released from any thread, and is deleted when the pool is full.
+	//
+
+	template<class T>
+	class CobjectPool
+	{
+	private:
+		std::mutex m_lock;
+		std::vector<T *> m_objects;
+		size_t m_maxNumber;
+
+		static void releaseObject(void *ptr)
+		{
+			instance().release((T *)ptr);
+		}
+
+	public:
+		CobjectPool(const size_t maxNumber = 16384)
+			:m_maxNumber(maxNumber) {}
+		~CobjectPool()
+		{
+			for (auto ptr : m_objects)
+				delete ptr;
+		}
+
+		// No copy, no move.
+		CobjectPool(const CobjectPool& another) = delete;
+		CobjectPool(CobjectPool&& another) = delete;
+		const CobjectPool& operator=(const CobjectPool& another) = delete;
+		const CobjectPool& operator=(CobjectPool&& another) = delete;
+
+		// Never destroyed, objects may be released by other static destructors at exit.
+		static CobjectPool& instance()
+		{
+			static CobjectPool *s_pool = new CobjectPool();
+			return *s_pool;
+		}
+
+		// Shared pointer which releases the object to instance() with the last reference.
+		static CmtSharedPtr<T> acquireShared()
+		{
+			return CmtSharedPtr<T>(instance().acquire(), releaseObject);
+		}
+
+		T *acquire()
+		{
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				if (!m_objects.empty())
+				{
+					T *ptr = m_objects.back();
+					m_objects.pop_back();
+					return ptr;
+				}
+			}
+			return new T();
+		}
+
+		void release(T * const ptr)
+		{
+			if (nullptr == ptr)
+				return;
+			ptr->recycle();
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				if (m_objects.size() < m_maxNumber)
+				{
+					m_objects.push_back(ptr);
+					return;
+				}
+			}
+			delete ptr;
+		}
+
+		void setMaxNumber(const size_t maxNumber)
+		{
+			std::vector<T *> extra;
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				m_maxNumber = maxNumber;
+				while (m_objects.size() > m_maxNumber)
+				{
+					extra.push_back(m_objects.back());
+					m_objects.pop_back();
+				}
+			}
+			for (auto ptr : extra)
+				delete ptr;
+		}
+
+		size_t size()
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			return m_objects.size();
+		}
+	};
+}
@@ -31,10 +31,13 @@
 namespace NETWORK_POOL
 {
 	#define RECV_BUFFER_SIZE (0xC00)
+	#define RECV_BUFFER_RECYCLE_SIZE (0x10000) // Grown buffer bigger than it is released when recycle, smaller is kept.
 
 	class CrecvBuffer
 	{
 	private:
+		const size_t m_originInitialBufferSize; // Restored when recycle.
+		const size_t m_originMaxBufferSize;
 		size_t m_initialBufferSize;
 		size_t m_maxBufferSize;
 
@@ -47,7 +50,8 @@ namespace NETWORK_POOL
 
 	public:
 		CrecvBuffer(const size_t initialBufferSize, const size_t maxBufferSize)
-			:m_initialBufferSize(initialBufferSize), m_maxBufferSize(maxBufferSize), m_nowIndex(0), m_bOverflow(false) {}
+			:m_originInitialBufferSize(initialBufferSize), m_originMaxBufferSize(maxBufferSize),
+			m_initialBufferSize(initialBufferSize), m_maxBufferSize(maxBufferSize), m_nowIndex(0), m_bOverflow(false) {}
 
 		~CrecvBuffer()
 		{
@@ -56,6 +60,37 @@ namespace NETWORK_POOL
 			m_rawBuffers.clear();
 		}
 
+		// Prefill the cache of receive block at startup.
+		static size_t prefillBuffer(const size_t number, const bool bTouch = true)
+		{
+			return __prefill_cache(RECV_BUFFER_SIZE, number, bTouch);
+		}
+
+		// Let receive block and grown buffer up to maxBufferSize use the huge page arena(Call after __enable_huge_arena).
+		static size_t useHugeArena(const size_t maxBufferSize)
+		{
+			return __use_huge_arena(RECV_BUFFER_SIZE, maxBufferSize);
+		}
+
+		// Reset for reuse(By CobjectPool) to the state of a fresh one, only the capacity of buffer may be kept.
+		void recycle()
+		{
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				for (const auto& pair : m_rawBuffers)
+					__free(pair.first);
+				m_rawBuffers.clear();
+			}
+			m_initialBufferSize = m_originInitialBufferSize;
+			m_maxBufferSize = m_originMaxBufferSize;
+			if (m_buffer.getMaxLength() > RECV_BUFFER_RECYCLE_SIZE || m_buffer.getMaxLength() < m_initialBufferSize)
+				m_buffer = Cbuffer();
+			else
+				m_buffer.resize(m_initialBufferSize); // Same length as merge gives a fresh one.
+			m_nowIndex = 0;
+			m_bOverflow = false;
+		}
+
 		//
 		// Following 3 functions should be called in event loop.
 		//
@@ -0,0 +1,226 @@
+/* Copyright (c) 2018 Zhenyu Zhang. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <utility>
+
+#include "network_type.h"
+
+namespace NETWORK_POOL
+{
+	//
+	// Socket id of a loop is generation | slot | loop, the slot indexes dense tables and the generation rejects stale id.
+	// Generation of a slot grows when it's released, and a slot is reused in FIFO order only when enough are free,
+	// so an id never overlaps an earlier one unless a single slot is reused 2^36 times.
+	//
+
+	class CslotAllocator
+	{
+	private:
+		std::vector<uint64_t> m_generations;
+		std::deque<size_t> m_freeSlots;
+		size_t m_loop;
+
+		static const size_t s_reuseFreeSlots = 1024;
+
+	public:
+		CslotAllocator(const size_t loop)
+			:m_loop(loop) {}
+
+		// No copy, no move.
+		CslotAllocator(const CslotAllocator& another) = delete;
+		CslotAllocator(CslotAllocator&& another) = delete;
+		const CslotAllocator& operator=(const CslotAllocator& another) = delete;
+		const CslotAllocator& operator=(CslotAllocator&& another) = delete;
+
+		// Return SOCKET_ID_UNSPEC when all slots are in use.
+		socket_id alloc()
+		{
+			size_t slot;
+			if (m_freeSlots.size() >= s_reuseFreeSlots || (m_generations.size() >= SOCKET_ID_SLOT_NUMBER && !m_freeSlots.empty()))
+			{
+				slot = m_freeSlots.front();
+				m_freeSlots.pop_front();
+			}
+			else if (m_generations.size() < SOCKET_ID_SLOT_NUMBER)
+			{
+				slot = m_generations.size();
+				m_generations.push_back(1); // Never SOCKET_ID_UNSPEC.
+			}
+			else
+				return SOCKET_ID_UNSPEC;
+			return (m_generations[slot] << SOCKET_ID_GENERATION_SHIFT) | ((socket_id)slot << SOCKET_ID_LOOP_BITS) | m_loop;
+		}
+
+		// Ignore id of other loop, stale id and id released twice.
+		void release(const socket_id socketId)
+		{
+			const size_t slot = SOCKET_ID_SLOT(socketId);
+			if (SOCKET_ID_LOOP(socketId) != m_loop || slot >= m_generations.size() || m_generations[slot] != SOCKET_ID_GENERATION(socketId))
+				return;
+			if (0 == (m_generations[slot] = (m_generations[slot] + 1) & SOCKET_ID_GENERATION_MASK))
+				m_generations[slot] = 1;
+			m_freeSlots.push_back(slot);
+		}
+	};
+
+	//
+	// Map from socket id of one loop to T, stored in a dense array indexed by slot.
+	// Find is one indexed load and a compare of the whole id, so the entry of a reused slot never matches a stale id.
+	// Only the subset of std::unordered_map used by the pool is provided, T should be default constructible and movable.
+	//
+
+	template<class T>
+	class CslotMap
+	{
+	public:
+		struct value_type
+		{
+			socket_id first; // SOCKET_ID_UNSPEC when empty.
+			T second;
+
+			value_type()
+				:first(SOCKET_ID_UNSPEC) {}
+		};
+
+		class iterator
+		{
+		private:
+			value_type *m_value;
+			value_type *m_end;
+
+			void skip()
+			{
+				while (m_value != m_end && SOCKET_ID_UNSPEC == m_value->first)
+					++m_value;
+			}
+
+			friend class CslotMap;
+
+		public:
+			iterator(value_type * const value, value_type * const end)
+				:m_value(value), m_end(end) {}
+
+			inline value_type& operator*() const
+			{
+				return *m_value;
+			}
+			inline value_type *operator->() const
+			{
+				return m_value;
+			}
+			inline iterator& operator++()
+			{
+				++m_value;
+				skip();
+				return *this;
+			}
+			inline bool operator==(const iterator& another) const
+			{
+				return m_value == another.m_value;
+			}
+			inline bool operator!=(const iterator& another) const
+			{
+				return m_value != another.m_value;
+			}
+		};
+
+	private:
+		std::vector<value_type> m_values;
+		size_t m_size;
+
+	public:
+		CslotMap()
+			:m_size(0) {}
+		CslotMap(CslotMap&& another)
+			:m_values(std::move(another.m_values)), m_size(another.m_size)
+		{
+			another.m_values.clear();
+			another.m_size = 0;
+		}
+
+		// No copy, no move assign.
+		CslotMap(const CslotMap& another) = delete;
+		const CslotMap& operator=(const CslotMap& another) = delete;
+		const CslotMap& operator=(CslotMap&& another) = delete;
+
+		inline size_t size() const
+		{
+			return m_size;
+		}
+		inline bool empty() const
+		{
+			return 0 == m_size;
+		}
+
+		inline iterator begin()
+		{
+			iterator it(m_values.data(), m_values.data() + m_values.size());
+			it.skip();
+			return it;
+		}
+		inline iterator end()
+		{
+			return iterator(m_values.data() + m_values.size(), m_values.data() + m_values.size());
+		}
+
+		inline iterator find(const socket_id socketId)
+		{
+			const size_t slot = SOCKET_ID_SLOT(socketId);
+			if (slot < m_values.size() && m_values[slot].first == socketId && socketId != SOCKET_ID_UNSPEC)
+				return iterator(&m_values[slot], m_values.data() + m_values.size());
+			return end();
+		}
+
+		// Fail if the slot is taken(By the same id, ids of a loop never share a live slot).
+		std::pair<iterator, bool> insert(std::pair<socket_id, T>&& value)
+		{
+			if (SOCKET_ID_UNSPEC == value.first)
+				return std::make_pair(end(), false);
+			const size_t slot = SOCKET_ID_SLOT(value.first);
+			if (slot >= m_values.size())
+				m_values.resize(slot + 1);
+			value_type& entry = m_values[slot];
+			if (entry.first != SOCKET_ID_UNSPEC)
+				return std::make_pair(iterator(&entry, m_values.data() + m_values.size()), false);
+			entry.first = value.first;
+			entry.second = std::move(value.second);
+			++m_size;
+			return std::make_pair(iterator(&entry, m_values.data() + m_values.size()), true);
+		}
+
+		void erase(const iterator& it)
+		{
+			it.m_value->first = SOCKET_ID_UNSPEC;
+			it.m_value->second = T();
+			--m_size;
+		}
+
+		void clear()
+		{
+			m_values.clear();
+			m_size = 0;
+		}
+	};
+}
@@ -0,0 +1,177 @@
+/* Copyright (c) 2018 Zhenyu Zhang. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace NETWORK_POOL
+{
+	// Node embedded in the object which waits in the wheel, it can unlink itself without the wheel.
+	struct __wheel_node
+	{
+		__wheel_node *m_prev;
+		__wheel_node *m_next;
+		uint64_t m_expire; // Tick of the slot it waits in.
+
+		__wheel_node()
+			:m_prev(nullptr), m_next(nullptr), m_expire(0) {}
+
+		inline bool isLinked() const
+		{
+			return m_next != nullptr;
+		}
+		inline void unlink()
+		{
+			if (nullptr == m_next)
+				return;
+			m_prev->m_next = m_next;
+			m_next->m_prev = m_prev;
+			m_prev = m_next = nullptr;
+		}
+	};
+
+	//
+	// Hierarchical timing wheel of 4 levels and 256 slots each, so add and remove are O(1) and advance is O(1) per tick.
+	// Nodes far away wait in upper levels and cascade down when the lower level turns a round.
+	// A node expires in the tick it's added for(Never earlier), or in the last tick the wheel can hold(2^32 ticks ahead).
+	//
+
+	class CtimingWheel
+	{
+	private:
+		static const size_t s_levelBits = 8;
+		static const size_t s_slotNumber = (size_t)1 << s_levelBits;
+		static const size_t s_levelNumber = 4;
+
+		__wheel_node m_slots[s_levelNumber][s_slotNumber]; // Sentinels of circular lists.
+		uint64_t m_current; // Last tick expired.
+
+		static inline void pushBack(__wheel_node * const head, __wheel_node * const node)
+		{
+			node->m_prev = head->m_prev;
+			node->m_next = head;
+			head->m_prev->m_next = node;
+			head->m_prev = node;
+		}
+
+		// Put the node by the distance from current tick(Expire not before current).
+		void place(__wheel_node * const node)
+		{
+			uint64_t delta = node->m_expire - m_current;
+			size_t level = 0;
+			while (level + 1 < s_levelNumber && delta >= ((uint64_t)1 << ((level + 1) * s_levelBits)))
+				++level;
+			if (delta >> (s_levelNumber * s_levelBits) != 0)
+			{
+				delta = ((uint64_t)1 << (s_levelNumber * s_levelBits)) - 1;
+				node->m_expire = m_current + delta;
+			}
+			pushBack(&m_slots[level][(node->m_expire >> (level * s_levelBits)) & (s_slotNumber - 1)], node);
+		}
+
+	public:
+		CtimingWheel()
+			:m_current(0)
+		{
+			for (auto& level : m_slots)
+				for (auto& head : level)
+					head.m_prev = head.m_next = &head;
+		}
+
+		// No copy, no move.
+		CtimingWheel(const CtimingWheel& another) = delete;
+		CtimingWheel(CtimingWheel&& another) = delete;
+		const CtimingWheel& operator=(const CtimingWheel& another) = delete;
+		const CtimingWheel& operator=(CtimingWheel&& another) = delete;
+
+		// Scan all slots, it's cheap enough for once a tick.
+		bool empty() const
+		{
+			for (const auto& level : m_slots)
+				for (const auto& head : level)
+					if (head.m_next != &head)
+						return false;
+			return true;
+		}
+
+		// Only when empty, so a wheel which stopped can start from now.
+		inline void reset(const uint64_t tick)
+		{
+			m_current = tick;
+		}
+		inline uint64_t current() const
+		{
+			return m_current;
+		}
+
+		// Node is unlinked first, and expires in the next tick if 'expire' has passed.
+		void add(__wheel_node * const node, const uint64_t expire)
+		{
+			node->unlink();
+			node->m_expire = expire > m_current ? expire : m_current + 1;
+			place(node);
+		}
+
+		// Expire every tick up to 'tick', expire(__wheel_node *) is called with the node unlinked.
+		// It can add or unlink any node, including the ones expire in the same tick.
+		template<class F>
+		void advance(const uint64_t tick, F expire)
+		{
+			while (m_current < tick)
+			{
+				++m_current;
+				// Cascade from the highest level whose lower levels turn a round, so a node can fall through more than one level.
+				size_t top = 0;
+				while (top + 1 < s_levelNumber && 0 == (m_current & (((uint64_t)1 << ((top + 1) * s_levelBits)) - 1)))
+					++top;
+				for (size_t level = top; level > 0; --level)
+				{
+					__wheel_node& head = m_slots[level][(m_current >> (level * s_levelBits)) & (s_slotNumber - 1)];
+					while (head.m_next != &head)
+					{
+						__wheel_node *node = head.m_next;
+						node->unlink();
+						place(node);
+					}
+				}
+				// Move the slot out first, so what's added meanwhile waits for its own tick.
+				__wheel_node& head = m_slots[0][m_current & (s_slotNumber - 1)];
+				if (head.m_next == &head)
+					continue;
+				__wheel_node due;
+				due.m_next = head.m_next;
+				due.m_prev = head.m_prev;
+				due.m_next->m_prev = &due;
+				due.m_prev->m_next = &due;
+				head.m_prev = head.m_next = &head;
+				while (due.m_next != &due)
+				{
+					__wheel_node *node = due.m_next;
+					node->unlink();
+					expire(node);
+				}
+			}
+		}
+	};
+}
@@ -22,13 +22,20 @@
 #pragma once
 
 #include <memory>
+#include <deque>
+#include <vector>
 
 #include "uv.h"
+#ifdef __linux__
+	#include <unistd.h>
+#endif
 
 #include "network_type.h"
 #include "network_setting.h"
 #include "network_callback.h"
 #include "cached_allocator.h"
+#include "buffer.h"
+#include "timing_wheel.h"
 
 namespace NETWORK_POOL
 {
@@ -52,6 +59,8 @@ namespace NETWORK_POOL
 	#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
 
 	class CnetworkPool;
+	// Slot of socket id is reused after its wrapper is deleted, nothing for SOCKET_ID_UNSPEC or id of other loop.
+	void __release_socket_id(CnetworkPool * const pool, const socket_id socketId);
 
 	class Casync : public CcachedAllocator
 	{
@@ -136,10 +145,15 @@ namespace NETWORK_POOL
 				uv_close((uv_handle_t *)&tcpServer->m_tcp,
 					[](uv_handle_t *handle)
 				{
-					delete CtcpServer::obtain(handle);
+					destroy(CtcpServer::obtain(handle));
 				});
 			}
 		}
+		static void destroy(CtcpServer * const tcpServer)
+		{
+			__release_socket_id(tcpServer->m_pool, tcpServer->m_socketId);
+			delete tcpServer;
+		}
 
 		template<class T>
 		friend struct __uv_wrapper_deleter;
@@ -155,6 +169,20 @@ namespace NETWORK_POOL
 			return true;
 		}
 
+		// Let listeners of every loop bind the same address, must be called before bind.
+		inline bool reusePort()
+		{
+		#ifdef SO_REUSEPORT
+			uv_os_fd_t fd;
+			if (uv_fileno((const uv_handle_t *)&m_tcp, &fd) != 0)
+				return false;
+			int on = 1;
+			return 0 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+		#else
+			return false;
+		#endif
+		}
+
 		inline uv_tcp_t *getTcp()
 		{
 			return &m_tcp;
@@ -194,69 +222,118 @@ namespace NETWORK_POOL
 			return container_of(tcp, CtcpServer, m_tcp);
 		}
 
-		static ptr alloc(CnetworkPool * const pool, uv_loop_t * const loop, CtcpServerCallback::ptr&& callback, const socket_id socketId)
+		// Socket is created at once when family is not AF_UNSPEC.
+		static ptr alloc(CnetworkPool * const pool, uv_loop_t * const loop, CtcpServerCallback::ptr&& callback, const socket_id socketId, const unsigned int family = AF_UNSPEC)
 		{
 			CtcpServer *tcpServer = new (std::nothrow) CtcpServer();
 			if (nullptr == tcpServer)
+			{
+				__release_socket_id(pool, socketId);
 				return std::move(ptr());
+			}
 			tcpServer->m_pool = pool;
 			tcpServer->m_callback = std::forward<CtcpServerCallback::ptr>(callback);
 			tcpServer->m_socketId = socketId;
-			if (uv_tcp_init(loop, &tcpServer->m_tcp) != 0)
+			if (uv_tcp_init_ex(loop, &tcpServer->m_tcp, family) != 0)
 			{
-				delete tcpServer;
+				destroy(tcpServer);
 				return std::move(ptr());
 			}
 			return std::move(ptr(tcpServer));
 		}
 	};
 
-	class Ctcp : public CcachedAllocator
+#ifdef __linux__
+	// File sent by sendfile after the corked data before it.
+	struct __tcp_file
+	{
+		int m_fd; // Owned.
+		int64_t m_offset;
+		size_t m_length; // Bytes left.
+		size_t m_corkIndex; // Number of corked buffers before it.
+	};
+#endif
+
+	class Ctcp : public CslabAllocator<Ctcp>
 	{
 		PRIVATE_CLASS(Ctcp)
 	private:
 		uv_tcp_t m_tcp;
-		uv_timer_t m_timer;
 		bool m_tcpInited;
-		bool m_timerInited;
 		bool m_closing;
 		bool m_shutdown;
 		CnetworkPool *m_pool;
 		CtcpCallback::ptr m_callback;
 		socket_id m_socketId;
+		// Timeout waits in the timing wheel of pool, activity only moves the deadline and the wheel re-arms it lazily.
+		__wheel_node m_timeoutNode;
+		uint64_t m_timeoutDeadline; // Loop time in milliseconds, 0 if no timeout.
+		// Data sent in this loop iteration, written together when the pool flushes.
+		std::vector<uv_buf_t> m_cork;
+		std::vector<__buffer_release> m_corkRelease;
+		size_t m_corkBytes;
+		bool m_corked;
+		bool m_writeBlocked; // Over high watermark and not yet fallen to low.
+		bool m_readPaused; // By memory budget of pool.
+	#ifdef __linux__
+		// Files wait for the data before them, and data after the first file waits in cork.
+		std::deque<__tcp_file> m_files;
+		bool m_sendingFile; // The first file is being sent.
+		uv_poll_t *m_filePoll; // Writable of duplicated socket, created by the first file.
+		int m_filePollFd;
+	#endif
 
 		static void close(Ctcp * const tcp)
 		{
 			if (nullptr == tcp)
 				return;
-			if (tcp->m_tcpInited || tcp->m_timerInited)
+			// Drop the data not written.
+			for (size_t i = 0; i < tcp->m_cork.size(); ++i)
+			{
+				if (tcp->m_callback)
+					tcp->m_callback->drop(tcp->m_cork[i].base, tcp->m_cork[i].len);
+				__release_buffer(tcp->m_cork[i], tcp->m_corkRelease[i]);
+			}
+			tcp->m_cork.clear();
+			tcp->m_corkRelease.clear();
+			tcp->m_corkBytes = 0;
+			tcp->m_timeoutNode.unlink();
+			tcp->m_timeoutDeadline = 0;
+		#ifdef __linux__
+			for (const auto& file : tcp->m_files)
+				::close(file.m_fd);
+			tcp->m_files.clear();
+			tcp->m_sendingFile = false;
+			if (tcp->m_filePoll != nullptr)
+			{
+				uv_close((uv_handle_t *)tcp->m_filePoll,
+					[](uv_handle_t *handle)
+				{
+					__free(handle);
+				});
+				::close(tcp->m_filePollFd); // Removed from loop by uv_close.
+				tcp->m_filePoll = nullptr;
+			}
+		#endif
+			if (tcp->m_tcpInited)
 			{
 				if (!tcp->m_closing)
 				{
-					// Both close callback should be set if initialized.
-					if (tcp->m_tcpInited)
-						uv_close((uv_handle_t *)&tcp->m_tcp,
+					uv_close((uv_handle_t *)&tcp->m_tcp,
 						[](uv_handle_t *handle)
 					{
-						Ctcp *tcp = Ctcp::obtainFromTcp(handle);
-						tcp->m_tcpInited = false;
-						if (!tcp->m_timerInited)
-							delete tcp;
-					});
-					if (tcp->m_timerInited)
-						uv_close((uv_handle_t *)&tcp->m_timer,
-						[](uv_handle_t *handle)
-					{
-						Ctcp *tcp = Ctcp::obtainFromTimer(handle);
-						tcp->m_timerInited = false;
-						if (!tcp->m_tcpInited)
-							delete tcp;
+						destroy(Ctcp::obtainFromTcp(handle));
 					});
 					tcp->m_closing = true;
 				}
 			}
 			else
-				delete tcp;
+				destroy(tcp);
+		}
+		static void destroy(Ctcp * const tcp)
+		{
+			__release_socket_id(tcp->m_pool, tcp->m_socketId);
+			delete tcp;
 		}
 
 		template<class T>
@@ -290,9 +367,17 @@ namespace NETWORK_POOL
 		{
 			return (uv_stream_t *)&m_tcp;
 		}
-		inline uv_timer_t *getTimer()
+		inline __wheel_node *getTimeoutNode()
+		{
+			return &m_timeoutNode;
+		}
+		inline uint64_t getTimeoutDeadline() const
+		{
+			return m_timeoutDeadline;
+		}
+		inline void setTimeoutDeadline(const uint64_t deadline)
 		{
-			return &m_timer;
+			m_timeoutDeadline = deadline;
 		}
 		inline CnetworkPool *getPool() const
 		{
@@ -316,13 +401,93 @@ namespace NETWORK_POOL
 			return m_shutdown;
 		}
 
-		static inline Ctcp *obtainFromTcp(uv_handle_t * const handle)
+		inline std::vector<uv_buf_t>& getCork()
 		{
-			return container_of(handle, Ctcp, m_tcp);
+			return m_cork;
+		}
+		inline std::vector<__buffer_release>& getCorkRelease()
+		{
+			return m_corkRelease;
+		}
+		inline bool isCorked() const
+		{
+			return m_corked;
+		}
+		inline void setCorked(const bool bCorked)
+		{
+			m_corked = bCorked;
+		}
+		inline size_t& corkBytes()
+		{
+			return m_corkBytes;
+		}
+		inline bool isWriteBlocked() const
+		{
+			return m_writeBlocked;
+		}
+		inline void setWriteBlocked(const bool bBlocked)
+		{
+			m_writeBlocked = bBlocked;
+		}
+		inline bool isReadPaused() const
+		{
+			return m_readPaused;
+		}
+		inline void setReadPaused(const bool bPaused)
+		{
+			m_readPaused = bPaused;
+		}
+
+	#ifdef __linux__
+		inline std::deque<__tcp_file>& getFiles()
+		{
+			return m_files;
+		}
+		inline bool isSendingFile() const
+		{
+			return m_sendingFile;
+		}
+		inline void setSendingFile(const bool bSending)
+		{
+			m_sendingFile = bSending;
+		}
+		// Duplicate the socket and poll it on first use, return nullptr if fail.
+		uv_poll_t *getFilePoll()
+		{
+			if (m_filePoll != nullptr)
+				return m_filePoll;
+			uv_os_fd_t fd;
+			if (uv_fileno((const uv_handle_t *)&m_tcp, &fd) != 0)
+				return nullptr;
+			uv_poll_t *poll = (uv_poll_t *)__alloc(sizeof(uv_poll_t));
+			if (nullptr == poll)
+				return nullptr;
+			const int pollFd = dup(fd);
+			if (pollFd < 0)
+			{
+				__free(poll);
+				return nullptr;
+			}
+			if (uv_poll_init(m_tcp.loop, poll, pollFd) != 0)
+			{
+				::close(pollFd);
+				__free(poll);
+				return nullptr;
+			}
+			poll->data = this;
+			m_filePoll = poll;
+			m_filePollFd = pollFd;
+			return poll;
 		}
-		static inline Ctcp *obtainFromTimer(uv_handle_t * const handle)
+		inline int getFilePollFd() const
 		{
-			return container_of(handle, Ctcp, m_timer);
+			return m_filePollFd;
+		}
+	#endif
+
+		static inline Ctcp *obtainFromTcp(uv_handle_t * const handle)
+		{
+			return container_of(handle, Ctcp, m_tcp);
 		}
 		static inline Ctcp *obtain(uv_stream_t * const stream)
 		{
@@ -332,32 +497,38 @@ namespace NETWORK_POOL
 		{
 			return container_of(tcp, Ctcp, m_tcp);
 		}
-		static inline Ctcp *obtain(uv_timer_t * const timer)
+		static inline Ctcp *obtain(__wheel_node * const node)
 		{
-			return container_of(timer, Ctcp, m_timer);
+			return container_of(node, Ctcp, m_timeoutNode);
 		}
 
-		static ptr alloc(CnetworkPool * const pool, uv_loop_t * const loop, CtcpCallback::ptr&& callback, const socket_id socketId, const bool initTimer = true)
+		static ptr alloc(CnetworkPool * const pool, uv_loop_t * const loop, CtcpCallback::ptr&& callback, const socket_id socketId)
 		{
 			Ctcp *tcp = new (std::nothrow) Ctcp();
 			if (nullptr == tcp)
+			{
+				__release_socket_id(pool, socketId);
 				return std::move(ptr());
+			}
 			tcp->m_tcpInited = false;
-			tcp->m_timerInited = false;
+			tcp->m_timeoutDeadline = 0;
 			tcp->m_closing = false;
 			tcp->m_shutdown = false;
+			tcp->m_corkBytes = 0;
+			tcp->m_corked = false;
+			tcp->m_writeBlocked = false;
+			tcp->m_readPaused = false;
+		#ifdef __linux__
+			tcp->m_sendingFile = false;
+			tcp->m_filePoll = nullptr;
+			tcp->m_filePollFd = -1;
+		#endif
 			tcp->m_pool = pool;
 			tcp->m_callback = std::forward<CtcpCallback::ptr>(callback);
 			tcp->m_socketId = socketId;
 			if (uv_tcp_init(loop, &tcp->m_tcp) != 0)
 				goto _ec;
 			tcp->m_tcpInited = true;
-			if (initTimer)
-			{
-				if (uv_timer_init(loop, &tcp->m_timer) != 0)
-					goto _ec;
-				tcp->m_timerInited = true;
-			}
 			return std::move(ptr(tcp));
 		_ec:
 			close(tcp);
@@ -411,10 +582,15 @@ namespace NETWORK_POOL
 				uv_close((uv_handle_t *)&udp->m_udp,
 					[](uv_handle_t *handle)
 				{
-					delete Cudp::obtain(handle);
+					destroy(Cudp::obtain(handle));
 				});
 			}
 		}
+		static void destroy(Cudp * const udp)
+		{
+			__release_socket_id(udp->m_pool, udp->m_socketId);
+			delete udp;
+		}
 
 		template<class T>
 		friend struct __uv_wrapper_deleter;
@@ -464,13 +640,16 @@ namespace NETWORK_POOL
 		{
 			Cudp *udp = new (std::nothrow) Cudp();
 			if (nullptr == udp)
+			{
+				__release_socket_id(pool, socketId);
 				return std::move(ptr());
+			}
 			udp->m_pool = pool;
 			udp->m_callback = std::forward<CudpCallback::ptr>(callback);
 			udp->m_socketId = socketId;
 			if (uv_udp_init(loop, &udp->m_udp) != 0)
 			{
-				delete udp;
+				destroy(udp);
 				return std::move(ptr());
 			}
 			return std::move(ptr(udp));
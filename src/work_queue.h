@@ -21,7 +21,6 @@
 
 #pragma once
 
-#include <memory>
 #include <vector>
 #include <deque>
 #include <mutex>
@@ -29,18 +28,10 @@
 #include <thread>
 #include <utility>
 
+#include "task.h"
+
 namespace NETWORK_POOL
 {
-	class Ctask
-	{
-	public:
-		typedef std::unique_ptr<Ctask> ptr;
-
-		virtual ~Ctask() {}
-
-		virtual void run() = 0;
-	};
-
 	class CworkQueue
 	{
 	private:
@@ -62,10 +53,10 @@ namespace NETWORK_POOL
 				{
 					Ctask::ptr ret(std::move(m_tasks.front()));
 					m_tasks.pop_front();
-					return std::move(ret);
+					return ret;
 				}
 			}
-			return std::move(Ctask::ptr());
+			return Ctask::ptr();
 		}
 
 		void worker()